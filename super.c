@@ -22,67 +22,1757 @@
 #include <linux/mm_inline.h>
 #include <linux/uio.h>
 #include <linux/sched/signal.h>
+#include <linux/vmalloc.h>
+#include <linux/pfn_t.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/prefetch.h>
+#include <linux/slab.h>
+#include <linux/percpu_counter.h>
+
+#define ARRAYFS_SUPER_MAGIC	0x41525246	/* "ARRF" */
 
 /* Eight directory inodes */
 #define ARRAY_FS_NR_DIRINODES (8)
 
+/*
+ * Default geometry, used when the mount options don't say otherwise.
+ * Without size= the block pool gets ARRAYFS_NR_PGS_PER_FILE blocks
+ * per inode.
+ */
 #define ARRAYFS_NR_INODES (32)
 #define ARRAYFS_NR_PGS_PER_FILE (8)
 
+/*
+ * The data area is allocated in chunks of one PMD each, so that a
+ * chunk we manage to get physically contiguous can be mapped huge.
+ */
+#define ARRAYFS_CHUNK_SHIFT	(PMD_SHIFT - PAGE_SHIFT)
+#define ARRAYFS_CHUNK_PAGES	(1UL << ARRAYFS_CHUNK_SHIFT)
+
+/*
+ * Block 0 is never handed out, so a zero block number means "hole"
+ * in an extent map. The root directory's first block is block 1.
+ */
+#define ARRAYFS_ROOT_BLK	(1)
+
+/*
+ * An extent map that outgrows the inode lives in a tree of blocks:
+ * leaves hold extents, index blocks hold block numbers.
+ */
+#define ARRAYFS_EXTENTS_PER_BLOCK	(PAGE_SIZE / sizeof(struct arrayfs_extent))
+#define ARRAYFS_PTR_SHIFT	(PAGE_SHIFT - 2)
+#define ARRAYFS_PTRS_PER_BLOCK	(1U << ARRAYFS_PTR_SHIFT)
+
+/* How many inode numbers and blocks a CPU reserves at a time */
+#define ARRAYFS_INO_BATCH	(16)
+#define ARRAYFS_BLK_BATCH	(64)
+
+/* Most blocks a directory maps ahead of its end at a time */
+#define ARRAYFS_DIR_PREALLOC	(ARRAYFS_CHUNK_PAGES)
+
+/* Inode records written back per hold of dirty_lock */
+#define ARRAYFS_FLUSH_BATCH	(64)
+
+/*
+ * Per-directory Bloom filter over the name hashes, built by the first
+ * lookup that misses. It gets at least 2^9 bits, 8 for every slot the
+ * directory's blocks have, and is rebuilt once it holds more entries
+ * than that, or once a quarter of what went in was removed.
+ */
+#define ARRAYFS_BLOOM_MIN_SHIFT	(9)
+#define ARRAYFS_BLOOM_HASHES	(3)
+
+/* Directory leaves are locked through a hashed table of spinlocks */
+#define ARRAYFS_DIR_LOCK_BITS	(8)
+
+/* Mount flags */
+#define ARRAYFS_MOUNT_PAGECACHE	0x00000001	/* page cache is the storage */
+#define ARRAYFS_MOUNT_DAX	0x00000002	/* file I/O goes to the array */
+
+#define test_opt(sbi, option)	((sbi)->mount_opt & ARRAYFS_MOUNT_##option)
+
+
+struct arrayfs_inode;
+struct arrayfs_disk_inode;
+
+struct arrayfs_chunk {
+	char *addr;
+	struct page *page;	/* first page, if physically contiguous */
+};
+
+/*
+ * Two-level allocation bitmap. @map has one bit per object, @full one
+ * bit per word of @map, set when that word has no free bit left, so
+ * a search skips a whole used word per summary bit. Searches are
+ * next-fit from @cursor. The owner's lock protects everything.
+ */
+struct arrayfs_bitmap {
+	unsigned long *map;
+	unsigned long *full;
+	unsigned long nbits;
+	unsigned long nwords;
+	unsigned long cursor;
+};
+
+/*
+ * Leaf writers hold @lock and bump @seq. Readers take neither, they
+ * read the leaf under RCU and retry if @seq moved.
+ */
+struct arrayfs_leaf_lock {
+	spinlock_t lock;
+	seqcount_t seq;
+} ____cacheline_aligned_in_smp;
+
+struct arrayfs_bloom {
+	struct rcu_head rcu;
+	unsigned int shift;	/* 1 << shift bits */
+	atomic_t nr_added;
+	atomic_t nr_removed;
+	unsigned long bits[];
+};
+
+/*
+ * Per-CPU cache of inode numbers and free blocks, reserved from the
+ * global bitmaps in batches so that creates on different CPUs don't
+ * all meet on cp_lock and blk_lock. The lock is only contended when
+ * a CPU that ran out drains everybody's magazine.
+ */
+struct arrayfs_magazine {
+	spinlock_t lock;
+	unsigned int nr_inos;
+	u32 inos[ARRAYFS_INO_BATCH];
+	u32 blk_next, blk_end;	/* reserved blocks [blk_next, blk_end) */
+};
 
+/*
+ * Everything belonging to one mount. Each arrayfs instance has its
+ * own storage, bitmaps and locks, hung off sb->s_fs_info.
+ */
 struct arrayfs_sb {
-	spinlock_t m_lock;
-	int mounted;
 	struct super_block *sb;
-	spinlock_t inode_bmlock;
-	unsigned long inode_bm;
 	spinlock_t cp_lock;
+
+	/* Geometry, fixed at mount time */
+	unsigned long nr_inodes;
+	unsigned long nr_blocks;
+	unsigned long max_file_pages;
+	unsigned int mount_opt;
+
+	/* ino -> live in-core inode, so iget can skip the inode hash */
+	struct inode __rcu **inode_table;
+	/* Inodes whose disk record is behind, flushed in batches */
+	spinlock_t dirty_lock;
+	struct list_head dirty_inodes;
+	/*
+	 * Each sync_fs pass opens a new sync_epoch and, once everything
+	 * dirtied before it is flushed, publishes it as synced_epoch.
+	 */
+	struct mutex sync_mutex;
+	atomic64_t sync_epoch;
+	atomic64_t synced_epoch;
+
+	/*
+	 * These are data storage. The data area is a pool of nr_blocks
+	 * page-sized blocks shared by all inodes; each inode finds its
+	 * blocks through its extent map. In pagecache mode only
+	 * directories take blocks from the pool.
+	 */
+	struct arrayfs_disk_inode *disk_inodes;
+	struct arrayfs_chunk *chunks;
+	unsigned long nr_chunks;
+	struct arrayfs_bitmap inode_map;	/* under cp_lock */
+	spinlock_t blk_lock;
+	struct arrayfs_bitmap block_map;
+	struct arrayfs_magazine __percpu *mags;
+	/*
+	 * Unlinked inodes whose last reference is gone. Their blocks and
+	 * inode numbers are given back in batches by reclaim_work.
+	 */
+	unsigned long *orphans;
+	struct workqueue_struct *reclaim_wq;
+	struct work_struct reclaim_work;
+	/* Handed-out counts for statfs; magazine reserves count as free */
+	struct percpu_counter free_blocks;
+	struct percpu_counter free_inodes;
+
+	struct arrayfs_leaf_lock dir_locks[1 << ARRAYFS_DIR_LOCK_BITS];
+};
+
+struct arrayfs_mount_opts {
+	unsigned long long size;
+	unsigned long nr_inodes;
+	unsigned long max_file_pages;
+	unsigned int flags;
 };
 
 struct arrayfs_inode {
 	struct inode vfs_inode;
+	struct rw_semaphore i_map_sem;	/* protects the extent map */
+	/* Held shared by mmap faults, exclusive while truncating */
+	struct rw_semaphore i_mmap_sem;
+	/*
+	 * Directories only: held shared to fill a leaf slot, exclusive to
+	 * split blocks, which also bumps i_dir_seq for lockless readers.
+	 * Leaf contents are guarded by the leaf's lock in sbi->dir_locks.
+	 */
+	struct rw_semaphore i_dir_sem;
+	seqcount_t i_dir_seq;
+	/* Replaced under i_dir_sem exclusive, read under RCU */
+	struct arrayfs_bloom __rcu *i_bloom;
+	unsigned long i_flags;
+	/* Directories only: readdir-then-stat detection, see arrayfs_lookup */
+	unsigned long i_readdir_time;
+	atomic_t i_prime_hits;
+	struct list_head i_dirty;	/* on sbi->dirty_inodes */
+	s64 i_dirty_epoch;		/* sync_epoch when last dirtied */
 };
 
-struct arrayfs_disk_inode {
-	umode_t mode;
-	unsigned long size;
+/* arrayfs_inode i_flags bits */
+#define ARRAYFS_I_PRIME_DCACHE	0	/* readdir should instantiate children */
+#define ARRAYFS_I_LISTED	1	/* a readdir pass has been started */
+
+/*
+ * A readdir pass primes the dcache with the children it returns if it
+ * is the first pass since the directory was read in, or if the last
+ * pass was followed by this many lookups that missed the dcache and
+ * found a name, within ARRAYFS_PRIME_WINDOW. At most ARRAYFS_PRIME_MAX
+ * children are primed per call.
+ */
+#define ARRAYFS_PRIME_HITS	(8)
+#define ARRAYFS_PRIME_WINDOW	(HZ)
+#define ARRAYFS_PRIME_MAX	(256)
+
+/* @len blocks starting at file block @lblk live at block @pblk */
+struct arrayfs_extent {
+	u32 lblk;
+	u32 pblk;
+	u32 len;
 };
 
-struct arrayfs_dir_entry {
-	char name[32];
+/*
+ * One cache line per inode, so reading an inode touches a single line.
+ * Times are in ns. The extent map is kept sorted by lblk. A single
+ * extent sits in the inode; from the second one on the whole map moves
+ * to the tree at ext_root, see arrayfs_extent.
+ */
+#define ARRAYFS_INODE_SIZE	(64)
+
+struct arrayfs_disk_inode {
+	u16 mode;
+	u16 flags;		/* none defined yet */
+	u32 nlink;
+	u64 size;
+	s64 atime;
+	s64 mtime;
+	s64 ctime;
+	u32 nr_extents;
+	union {
+		struct arrayfs_extent extent;	/* nr_extents <= 1 */
+		u32 ext_root;			/* nr_extents > 1 */
+	};
+	u32 uid;
+	u32 gid;
+} __aligned(ARRAYFS_INODE_SIZE);
+
+/*
+ * Directories are a tree keyed by name hash. Block 0 of a directory
+ * is the root; while the directory is small it is a single leaf.
+ * Index blocks sit above the leaves, at most ARRAYFS_DX_MAX_DEPTH
+ * levels of them.
+ *
+ * A leaf is a slotted page. It starts with one tag byte per slot:
+ * 0 for a free slot, ARRAYFS_TAG_RESERVED while a create fills it,
+ * else 0x80 and 7 bits of the name hash. Lookups compare the tags a
+ * word at a time and only look at the entries whose tag matches.
+ * Each used slot points at a variable-length record; records are
+ * packed against the end of the block and compacted when the
+ * holes left behind are needed.
+ *
+ * The hash doubles as the readdir cookie, so it is kept to 31 bits
+ * and ARRAYFS_HASH_EOF is never a real hash.
+ */
+#define ARRAYFS_DIR_SLOTS	(128)
+#define ARRAYFS_TAG_WORDS	(ARRAYFS_DIR_SLOTS / sizeof(u64))
+#define ARRAYFS_TAG_RESERVED	(0x01)
+#define ARRAYFS_NAME_LEN	(255)
+#define ARRAYFS_HASH_EOF	(0x7fffffff)
+#define ARRAYFS_DX_MAX_DEPTH	(3)
+
+/* The name is not NUL terminated */
+struct arrayfs_dir_rec {
 	u32 ino;
+	u32 hash;
+	u8 name_len;
+	u8 file_type;
+	char name[];
 };
 
+#define ARRAYFS_REC_LEN(len)	ALIGN(offsetof(struct arrayfs_dir_rec, name) + \
+					(len), 4)
+
+/* A leaf, level 0, followed by the record area */
 struct arrayfs_dir_data {
-	unsigned long bitmap;
-	struct arrayfs_dir_entry entries[64];
+	u32 level;
+	u16 used;	/* record bytes at the end of the block */
+	u16 dead;	/* of those, bytes no slot points at any more */
+	union {
+		u8 tags[ARRAYFS_DIR_SLOTS];
+		u64 tag_words[ARRAYFS_TAG_WORDS];
+	} ____cacheline_aligned;
+	u16 offs[ARRAYFS_DIR_SLOTS];	/* record offsets in the block */
+};
+
+#define ARRAYFS_DIR_HDR		sizeof(struct arrayfs_dir_data)
+
+/* Hashes from @hash up to the next entry's live under block @lblk */
+struct arrayfs_dx_entry {
+	u32 hash;
+	u32 lblk;
+};
+
+#define ARRAYFS_DX_LIMIT	((PAGE_SIZE - 2 * sizeof(u32)) / \
+					sizeof(struct arrayfs_dx_entry))
+
+/* An index block, level 1 and up, entries sorted by hash */
+struct arrayfs_dx_node {
+	u32 level;
+	u32 count;
+	struct arrayfs_dx_entry entries[ARRAYFS_DX_LIMIT];
 };
 
 static struct inode *arrayfs_iget(struct super_block *sb, unsigned long ino);
+static void arrayfs_publish_inode(struct inode *inode);
 const struct inode_operations arrayfs_dir_iops;
 const struct inode_operations arrayfs_file_iops;
 const struct file_operations arrayfs_dir_operations;
 const struct file_operations arrayfs_file_operations;
 const struct address_space_operations arrayfs_file_aops;
+const struct address_space_operations arrayfs_pagecache_aops;
+static struct kmem_cache *arrayfs_inode_cachep;
+
+static inline struct arrayfs_inode *ARRAYFS_I(struct inode *inode)
+{
+	return container_of(inode, struct arrayfs_inode, vfs_inode);
+}
+
+static inline struct arrayfs_sb *ARRAYFS_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+static inline struct arrayfs_sb *ARRAYFS_I_SB(struct inode *inode)
+{
+	return ARRAYFS_SB(inode->i_sb);
+}
+
+static inline struct arrayfs_disk_inode *arrayfs_di(struct inode *inode)
+{
+	return &ARRAYFS_I_SB(inode)->disk_inodes[inode->i_ino];
+}
+
+static inline char *arrayfs_blk_addr(struct arrayfs_sb *sbi, u32 blk)
+{
+	struct arrayfs_chunk *c = &sbi->chunks[blk >> ARRAYFS_CHUNK_SHIFT];
+
+	return c->addr + ((blk & (ARRAYFS_CHUNK_PAGES - 1)) << PAGE_SHIFT);
+}
+
+static inline struct page *arrayfs_blk_page(struct arrayfs_sb *sbi, u32 blk)
+{
+	struct arrayfs_chunk *c = &sbi->chunks[blk >> ARRAYFS_CHUNK_SHIFT];
+
+	if (c->page)
+		return c->page + (blk & (ARRAYFS_CHUNK_PAGES - 1));
+	return vmalloc_to_page(arrayfs_blk_addr(sbi, blk));
+}
+
+/* Pages still to be copied to their blocks, or being copied right now */
+static inline bool arrayfs_mapping_busy(struct address_space *mapping)
+{
+	return mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+		mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK);
+}
+
+static int arrayfs_bitmap_init(struct arrayfs_bitmap *bm, unsigned long nbits)
+{
+	bm->nbits = nbits;
+	bm->nwords = BITS_TO_LONGS(nbits);
+	bm->cursor = 0;
+	bm->map = kvcalloc(bm->nwords, sizeof(unsigned long), GFP_KERNEL);
+	bm->full = kvcalloc(BITS_TO_LONGS(bm->nwords), sizeof(unsigned long),
+				GFP_KERNEL);
+	if (!bm->map || !bm->full)
+		return -ENOMEM;
+
+	/* Bits past the end are never free */
+	if (nbits % BITS_PER_LONG)
+		bm->map[bm->nwords - 1] = ~0UL << (nbits % BITS_PER_LONG);
+	return 0;
+}
+
+static void arrayfs_bitmap_destroy(struct arrayfs_bitmap *bm)
+{
+	kvfree(bm->map);
+	kvfree(bm->full);
+	bm->map = NULL;
+	bm->full = NULL;
+}
+
+static void arrayfs_bitmap_set(struct arrayfs_bitmap *bm,
+				unsigned long start, unsigned long len)
+{
+	unsigned long w;
+
+	bitmap_set(bm->map, start, len);
+	for (w = BIT_WORD(start); w <= BIT_WORD(start + len - 1); w++)
+		if (bm->map[w] == ~0UL)
+			__set_bit(w, bm->full);
+}
+
+static void arrayfs_bitmap_clear(struct arrayfs_bitmap *bm,
+				unsigned long start, unsigned long len)
+{
+	unsigned long first = BIT_WORD(start);
+
+	bitmap_clear(bm->map, start, len);
+	bitmap_clear(bm->full, first, BIT_WORD(start + len - 1) - first + 1);
+}
+
+/* First free bit at or after @goal, wrapping around, or nbits if none */
+static unsigned long arrayfs_bitmap_find(struct arrayfs_bitmap *bm,
+				unsigned long goal)
+{
+	unsigned long w = BIT_WORD(goal);
+	unsigned long free = ~bm->map[w] >> (goal % BITS_PER_LONG);
+
+	if (free)
+		return goal + __ffs(free);
+
+	w = find_next_zero_bit(bm->full, bm->nwords, w + 1);
+	if (w >= bm->nwords)
+		w = find_first_zero_bit(bm->full, bm->nwords);
+	if (w >= bm->nwords)
+		return bm->nbits;
+	return w * BITS_PER_LONG + ffz(bm->map[w]);
+}
+
+/*
+ * Take a run of up to @want free bits, starting at the first free bit
+ * from @goal, or from the cursor if @goal is 0. Returns the first bit
+ * and the run length in *got, or nbits if nothing is free.
+ */
+static unsigned long arrayfs_bitmap_alloc(struct arrayfs_bitmap *bm,
+				unsigned long goal, unsigned long want,
+				unsigned long *got)
+{
+	unsigned long start, end;
+
+	if (!goal || goal >= bm->nbits)
+		goal = bm->cursor;
+
+	start = arrayfs_bitmap_find(bm, goal);
+	if (start >= bm->nbits)
+		return bm->nbits;
+	end = find_next_bit(bm->map, min(bm->nbits, start + want), start);
+	arrayfs_bitmap_set(bm, start, end - start);
+
+	bm->cursor = end < bm->nbits ? end : 0;
+	*got = end - start;
+	return start;
+}
+
+static u32 __arrayfs_alloc_blocks(struct arrayfs_sb *sbi, u32 goal, u32 want,
+				u32 *got)
+{
+	unsigned long start, n;
+
+	spin_lock(&sbi->blk_lock);
+	start = arrayfs_bitmap_alloc(&sbi->block_map, goal, want, &n);
+	spin_unlock(&sbi->blk_lock);
+	if (start >= sbi->nr_blocks)
+		return 0;
+
+	*got = n;
+	return start;
+}
+
+/* Give every CPU's reserved inode numbers and blocks back */
+static void arrayfs_drain_magazines(struct arrayfs_sb *sbi)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct arrayfs_magazine *mag = per_cpu_ptr(sbi->mags, cpu);
+
+		spin_lock(&mag->lock);
+		if (mag->nr_inos) {
+			spin_lock(&sbi->cp_lock);
+			while (mag->nr_inos)
+				arrayfs_bitmap_clear(&sbi->inode_map,
+						mag->inos[--mag->nr_inos], 1);
+			spin_unlock(&sbi->cp_lock);
+		}
+		if (mag->blk_next < mag->blk_end) {
+			spin_lock(&sbi->blk_lock);
+			arrayfs_bitmap_clear(&sbi->block_map, mag->blk_next,
+					mag->blk_end - mag->blk_next);
+			spin_unlock(&sbi->blk_lock);
+		}
+		mag->blk_next = mag->blk_end = 0;
+		spin_unlock(&mag->lock);
+	}
+}
+
+/*
+ * Block allocator. Hands out a run of up to @want free blocks, looking
+ * from @goal onwards first. Returns the first block and stores the
+ * run length in *got, or returns 0 if the pool is full.
+ *
+ * Small requests with no goal, or whose goal is where this CPU's
+ * reserved window continues, are served from the window. Everything
+ * else goes to the global bitmap, which keeps large files contiguous.
+ */
+static u32 arrayfs_alloc_blocks(struct arrayfs_sb *sbi, u32 goal, u32 want,
+				u32 *got)
+{
+	struct arrayfs_magazine *mag;
+	u32 blk = 0, n;
+
+	if (want <= ARRAYFS_BLK_BATCH) {
+		mag = get_cpu_ptr(sbi->mags);
+		spin_lock(&mag->lock);
+		if (mag->blk_next == mag->blk_end && !goal) {
+			mag->blk_next = __arrayfs_alloc_blocks(sbi, 0,
+						ARRAYFS_BLK_BATCH, &n);
+			mag->blk_end = mag->blk_next ? mag->blk_next + n : 0;
+		}
+		if (mag->blk_next < mag->blk_end &&
+				(!goal || goal == mag->blk_next)) {
+			blk = mag->blk_next;
+			*got = min(want, mag->blk_end - blk);
+			mag->blk_next += *got;
+		}
+		spin_unlock(&mag->lock);
+		put_cpu_ptr(sbi->mags);
+		if (blk) {
+			percpu_counter_sub(&sbi->free_blocks, *got);
+			return blk;
+		}
+	}
+
+	blk = __arrayfs_alloc_blocks(sbi, goal, want, got);
+	if (!blk) {
+		arrayfs_drain_magazines(sbi);
+		blk = __arrayfs_alloc_blocks(sbi, goal, want, got);
+	}
+	if (blk)
+		percpu_counter_sub(&sbi->free_blocks, *got);
+	return blk;
+}
+
+/* Free blocks must be zeroed already, allocation doesn't clear them */
+static void arrayfs_free_blocks(struct arrayfs_sb *sbi, u32 start, u32 len)
+{
+	percpu_counter_add(&sbi->free_blocks, len);
+	spin_lock(&sbi->blk_lock);
+	arrayfs_bitmap_clear(&sbi->block_map, start, len);
+	spin_unlock(&sbi->blk_lock);
+}
+
+static void arrayfs_zero_blocks(struct arrayfs_sb *sbi, u32 start, u32 len)
+{
+	for (; len; start++, len--) {
+		memset(arrayfs_blk_addr(sbi, start), 0, PAGE_SIZE);
+		cond_resched();
+	}
+}
+
+/* Extents under a tree block @level levels above the leaves */
+static inline u64 arrayfs_ext_span(unsigned int level)
+{
+	return (u64)ARRAYFS_EXTENTS_PER_BLOCK << (level * ARRAYFS_PTR_SHIFT);
+}
+
+/* Levels of the tree holding @nr extents, the leaves included */
+static unsigned int arrayfs_ext_height(u32 nr)
+{
+	unsigned int h = 1;
+
+	while (arrayfs_ext_span(h - 1) < nr)
+		h++;
+	return h;
+}
+
+/* Slot of leaf @leaf in a tree block @level levels above the leaves */
+static inline u32 *arrayfs_ext_slot(struct arrayfs_sb *sbi, u32 blk,
+				unsigned int level, u32 leaf)
+{
+	u32 *ptrs = (u32 *)arrayfs_blk_addr(sbi, blk);
+
+	return &ptrs[(leaf >> ((level - 1) * ARRAYFS_PTR_SHIFT)) &
+				(ARRAYFS_PTRS_PER_BLOCK - 1)];
+}
+
+/*
+ * Extent @i of the map. The tree is filled in order, so like a radix
+ * tree the path to an extent follows from its index alone, and its
+ * height from nr_extents. Lockless directory readers may walk it while
+ * it changes, so block numbers are checked against the pool; block 0
+ * is never handed out and only ever reads as a garbage extent.
+ */
+static struct arrayfs_extent *arrayfs_extent(struct arrayfs_sb *sbi,
+				struct arrayfs_disk_inode *di, u32 i)
+{
+	u32 nr = READ_ONCE(di->nr_extents);
+	u32 leaf = i / ARRAYFS_EXTENTS_PER_BLOCK;
+	u32 blk = READ_ONCE(di->ext_root);
+	unsigned int level;
+
+	if (nr <= 1)
+		return &di->extent;
+	for (level = arrayfs_ext_height(nr) - 1; level; level--) {
+		if (blk >= sbi->nr_blocks)
+			blk = 0;
+		blk = READ_ONCE(*arrayfs_ext_slot(sbi, blk, level, leaf));
+	}
+	if (blk >= sbi->nr_blocks)
+		blk = 0;
+	return (struct arrayfs_extent *)arrayfs_blk_addr(sbi, blk) +
+				i % ARRAYFS_EXTENTS_PER_BLOCK;
+}
+
+/*
+ * Free the tree blocks under @blk, which sits @level levels above the
+ * leaves and whose first extent is @base, that only hold extents from
+ * @first on. Returns true if that took @blk itself.
+ */
+static bool arrayfs_ext_prune(struct arrayfs_sb *sbi, u32 blk,
+				unsigned int level, u64 base, u64 first)
+{
+	u32 *ptrs;
+	u64 span;
+	u32 c;
+
+	if (level) {
+		ptrs = (u32 *)arrayfs_blk_addr(sbi, blk);
+		span = arrayfs_ext_span(level - 1);
+		for (c = 0; c < ARRAYFS_PTRS_PER_BLOCK; c++) {
+			if (!ptrs[c] || base + (c + 1) * span <= first)
+				continue;
+			if (arrayfs_ext_prune(sbi, ptrs[c], level - 1,
+						base + c * span, first))
+				ptrs[c] = 0;
+		}
+	}
+	if (first > base)
+		return false;
+	arrayfs_zero_blocks(sbi, blk, 1);
+	arrayfs_free_blocks(sbi, blk, 1);
+	return true;
+}
+
+/*
+ * Cut the map down to its first @nr extents and free the tree blocks
+ * no longer needed. The map goes back into the inode at one extent.
+ */
+static void arrayfs_ext_trim(struct arrayfs_sb *sbi,
+				struct arrayfs_disk_inode *di, u32 nr)
+{
+	struct arrayfs_extent first = {};
+	unsigned int h;
+	u32 root;
+
+	if (di->nr_extents <= 1) {
+		di->nr_extents = nr;
+		return;
+	}
+
+	h = arrayfs_ext_height(di->nr_extents);
+	root = di->ext_root;
+	if (nr <= 1) {
+		if (nr)
+			first = *arrayfs_extent(sbi, di, 0);
+		arrayfs_ext_prune(sbi, root, h - 1, 0, 0);
+		di->extent = first;
+		di->nr_extents = nr;
+		return;
+	}
+
+	arrayfs_ext_prune(sbi, root, h - 1, 0, nr);
+	/* Everything left hangs off the first slot of the top levels */
+	for (; h > arrayfs_ext_height(nr); h--) {
+		u32 child = *(u32 *)arrayfs_blk_addr(sbi, root);
+
+		arrayfs_zero_blocks(sbi, root, 1);
+		arrayfs_free_blocks(sbi, root, 1);
+		root = child;
+	}
+	di->ext_root = root;
+	di->nr_extents = nr;
+}
+
+/*
+ * Make room for one more extent at the end of the map, allocating tree
+ * blocks near @goal. The map leaves the inode at its second extent and
+ * the tree grows a level whenever it is full.
+ */
+static int arrayfs_ext_grow(struct arrayfs_sb *sbi,
+				struct arrayfs_disk_inode *di, u32 goal)
+{
+	u32 nr = di->nr_extents;
+	u32 root, blk, got, *slot;
+	unsigned int h, level;
+
+	if (nr == 1) {
+		blk = arrayfs_alloc_blocks(sbi, goal, 1, &got);
+		if (!blk)
+			return -ENOSPC;
+		*(struct arrayfs_extent *)arrayfs_blk_addr(sbi, blk) =
+							di->extent;
+		di->ext_root = blk;
+	} else if (nr && !(nr % ARRAYFS_EXTENTS_PER_BLOCK)) {
+		h = arrayfs_ext_height(nr);
+		root = di->ext_root;
+		if (arrayfs_ext_height(nr + 1) > h) {
+			blk = arrayfs_alloc_blocks(sbi, goal, 1, &got);
+			if (!blk)
+				return -ENOSPC;
+			*(u32 *)arrayfs_blk_addr(sbi, blk) = root;
+			root = blk;
+			h++;
+		}
+
+		/*
+		 * A failure part way down leaves blocks past the last
+		 * extent, which the next grow reuses and trim frees.
+		 */
+		blk = root;
+		for (level = h - 1; level; level--) {
+			slot = arrayfs_ext_slot(sbi, blk, level,
+					nr / ARRAYFS_EXTENTS_PER_BLOCK);
+			if (!*slot)
+				*slot = arrayfs_alloc_blocks(sbi, goal, 1,
+							&got);
+			blk = *slot;
+			if (!blk)
+				break;
+		}
+		if (!blk) {
+			/* Undo a new top level and what got under it */
+			if (root != di->ext_root) {
+				arrayfs_ext_prune(sbi, root, h - 1, 0, nr);
+				arrayfs_zero_blocks(sbi, root, 1);
+				arrayfs_free_blocks(sbi, root, 1);
+			}
+			return -ENOSPC;
+		}
+		di->ext_root = root;
+	}
+	di->nr_extents++;
+	return 0;
+}
+
+/* Index of the first extent starting after @lblk */
+static u32 arrayfs_extent_search(struct arrayfs_sb *sbi,
+				struct arrayfs_disk_inode *di, u32 lblk)
+{
+	u32 lo = 0, hi = di->nr_extents;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (arrayfs_extent(sbi, di, mid)->lblk > lblk)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/*
+ * Look @lblk up in the extent map. Returns the block it lives in, or 0
+ * for a hole. If @count isn't NULL it gets the number of blocks from
+ * @lblk to the end of the extent, or to the end of the hole.
+ */
+static u32 arrayfs_bmap(struct arrayfs_sb *sbi, struct arrayfs_disk_inode *di,
+				u32 lblk, u32 *count)
+{
+	u32 i = arrayfs_extent_search(sbi, di, lblk);
+	struct arrayfs_extent *ext;
+
+	if (i > 0) {
+		ext = arrayfs_extent(sbi, di, i - 1);
+		if (lblk - ext->lblk < ext->len) {
+			if (count)
+				*count = ext->len - (lblk - ext->lblk);
+			return ext->pblk + (lblk - ext->lblk);
+		}
+	}
+	if (count) {
+		if (i < di->nr_extents)
+			*count = arrayfs_extent(sbi, di, i)->lblk - lblk;
+		else
+			*count = U32_MAX - lblk;
+	}
+	return 0;
+}
+
+/*
+ * Add a freshly allocated run to the extent map, merging it with its
+ * neighbours when they are contiguous on both sides.
+ */
+static int arrayfs_insert_extent(struct arrayfs_sb *sbi,
+				struct arrayfs_disk_inode *di,
+				u32 lblk, u32 pblk, u32 len)
+{
+	u32 i = arrayfs_extent_search(sbi, di, lblk);
+	struct arrayfs_extent *prev = NULL, *next = NULL;
+	u32 j;
+	int err;
+
+	if (i > 0)
+		prev = arrayfs_extent(sbi, di, i - 1);
+	if (i < di->nr_extents)
+		next = arrayfs_extent(sbi, di, i);
+
+	if (prev && prev->lblk + prev->len == lblk &&
+			prev->pblk + prev->len == pblk) {
+		prev->len += len;
+		if (next && lblk + len == next->lblk &&
+				pblk + len == next->pblk) {
+			prev->len += next->len;
+			for (j = i; j + 1 < di->nr_extents; j++)
+				*arrayfs_extent(sbi, di, j) =
+					*arrayfs_extent(sbi, di, j + 1);
+			arrayfs_ext_trim(sbi, di, di->nr_extents - 1);
+		}
+		return 0;
+	}
+	if (next && lblk + len == next->lblk && pblk + len == next->pblk) {
+		next->lblk = lblk;
+		next->pblk = pblk;
+		next->len += len;
+		return 0;
+	}
+
+	err = arrayfs_ext_grow(sbi, di, pblk);
+	if (err)
+		return err;
+	for (j = di->nr_extents - 1; j > i; j--)
+		*arrayfs_extent(sbi, di, j) = *arrayfs_extent(sbi, di, j - 1);
+	next = arrayfs_extent(sbi, di, i);
+	next->lblk = lblk;
+	next->pblk = pblk;
+	next->len = len;
+	return 0;
+}
+
+/*
+ * Map up to @max blocks of @inode starting at @lblk. *pblk gets the
+ * first block, or 0 for a hole, and *len the length of the run. With
+ * @create a hole is filled with a run from the allocator, placed right
+ * after the previous block of the file when possible.
+ */
+static int arrayfs_get_blocks(struct inode *inode, u32 lblk, u32 max,
+				bool create, u32 *pblk, u32 *len)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	struct arrayfs_disk_inode *di = arrayfs_di(inode);
+	u32 p, n, goal = 0;
+	int err = 0;
+
+	down_read(&ai->i_map_sem);
+	p = arrayfs_bmap(sbi, di, lblk, &n);
+	up_read(&ai->i_map_sem);
+	if (p || !create)
+		goto out;
+
+	down_write(&ai->i_map_sem);
+	p = arrayfs_bmap(sbi, di, lblk, &n);
+	if (!p) {
+		n = min(n, max);
+		if (lblk)
+			goal = arrayfs_bmap(sbi, di, lblk - 1, NULL);
+		if (goal)
+			goal++;
+		p = arrayfs_alloc_blocks(sbi, goal, n, &n);
+		if (!p) {
+			err = -ENOSPC;
+		} else {
+			err = arrayfs_insert_extent(sbi, di, lblk, p, n);
+			if (err) {
+				arrayfs_free_blocks(sbi, p, n);
+				p = 0;
+			}
+		}
+	}
+	up_write(&ai->i_map_sem);
+out:
+	*pblk = p;
+	*len = min(n, max);
+	return err;
+}
+
+/*
+ * Drop the blocks of @di from file block @first on. Extents are cut
+ * from the end, each one zeroed and handed back to the allocator as a
+ * single run.
+ */
+static void arrayfs_free_extents(struct arrayfs_sb *sbi,
+				struct arrayfs_disk_inode *di, u32 first)
+{
+	struct arrayfs_extent *ext;
+	u32 i, keep;
+
+	for (i = di->nr_extents; i; i--) {
+		ext = arrayfs_extent(sbi, di, i - 1);
+		if (ext->lblk + ext->len <= first)
+			break;
+		keep = ext->lblk < first ? first - ext->lblk : 0;
+		arrayfs_zero_blocks(sbi, ext->pblk + keep, ext->len - keep);
+		arrayfs_free_blocks(sbi, ext->pblk + keep, ext->len - keep);
+		if (keep) {
+			ext->len = keep;
+			break;
+		}
+	}
+	arrayfs_ext_trim(sbi, di, i);
+}
+
+/*
+ * Drop every block of @inode past @size. The tail of the last block is
+ * zeroed too, so that growing the file again reads zeroes there. The
+ * page cache must be truncated already.
+ */
+static void arrayfs_truncate_blocks(struct inode *inode, loff_t size)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	struct arrayfs_disk_inode *di = arrayfs_di(inode);
+	unsigned int off = size & ~PAGE_MASK;
+	u32 blk;
+
+	down_write(&ai->i_map_sem);
+	if (off) {
+		blk = arrayfs_bmap(sbi, di, size >> PAGE_SHIFT, NULL);
+		if (blk)
+			memset(arrayfs_blk_addr(sbi, blk) + off, 0,
+					PAGE_SIZE - off);
+	}
+	arrayfs_free_extents(sbi, di, DIV_ROUND_UP(size, PAGE_SIZE));
+	up_write(&ai->i_map_sem);
+}
+
+static void arrayfs_set_file_ops(struct inode *inode)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+
+	inode->i_op = &arrayfs_file_iops;
+	inode->i_fop = &arrayfs_file_operations;
+	if (test_opt(sbi, DAX))
+		inode->i_flags |= S_DAX;
+	if (test_opt(sbi, PAGECACHE)) {
+		/* Like ramfs: the pages are pinned and never written back */
+		inode->i_mapping->a_ops = &arrayfs_pagecache_aops;
+		mapping_set_gfp_mask(inode->i_mapping, GFP_HIGHUSER);
+		mapping_set_unevictable(inode->i_mapping);
+	} else {
+		inode->i_mapping->a_ops = &arrayfs_file_aops;
+	}
+}
+
+/*
+ * Inode numbers come from this CPU's magazine, which is refilled a
+ * batch at a time under cp_lock. Returns nr_inodes if there are none
+ * left anywhere.
+ */
+static unsigned long arrayfs_alloc_ino(struct arrayfs_sb *sbi)
+{
+	struct arrayfs_magazine *mag;
+	unsigned long ino = sbi->nr_inodes, start, n;
+
+	mag = get_cpu_ptr(sbi->mags);
+	spin_lock(&mag->lock);
+	if (!mag->nr_inos) {
+		spin_lock(&sbi->cp_lock);
+		while (mag->nr_inos < ARRAYFS_INO_BATCH) {
+			start = arrayfs_bitmap_alloc(&sbi->inode_map, 0,
+					ARRAYFS_INO_BATCH - mag->nr_inos, &n);
+			if (start >= sbi->nr_inodes)
+				break;
+			/* Lowest number on top */
+			for (; n; n--)
+				mag->inos[mag->nr_inos++] = start + n - 1;
+		}
+		spin_unlock(&sbi->cp_lock);
+	}
+	if (mag->nr_inos)
+		ino = mag->inos[--mag->nr_inos];
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(sbi->mags);
+	if (ino >= sbi->nr_inodes) {
+		arrayfs_drain_magazines(sbi);
+		spin_lock(&sbi->cp_lock);
+		ino = arrayfs_bitmap_alloc(&sbi->inode_map, 0, 1, &n);
+		spin_unlock(&sbi->cp_lock);
+	}
+	if (ino < sbi->nr_inodes)
+		percpu_counter_dec(&sbi->free_inodes);
+	return ino;
+}
+
+static void arrayfs_free_ino(struct arrayfs_sb *sbi, unsigned long ino)
+{
+	struct arrayfs_magazine *mag;
+
+	percpu_counter_inc(&sbi->free_inodes);
+	mag = get_cpu_ptr(sbi->mags);
+	spin_lock(&mag->lock);
+	if (mag->nr_inos < ARRAYFS_INO_BATCH) {
+		mag->inos[mag->nr_inos++] = ino;
+		ino = sbi->nr_inodes;
+	}
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(sbi->mags);
+	if (ino == sbi->nr_inodes)
+		return;
+
+	spin_lock(&sbi->cp_lock);
+	arrayfs_bitmap_clear(&sbi->inode_map, ino, 1);
+	spin_unlock(&sbi->cp_lock);
+}
 
+/*
+ * Lockless readers may get here while the extent map is being changed
+ * and see nonsense, which they'll retry, so never trust the block
+ * number further than the pool.
+ */
+static void *arrayfs_dir_block(struct inode *dir, u32 lblk)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(dir);
+	u32 blk = arrayfs_bmap(sbi, arrayfs_di(dir), lblk, NULL);
+
+	if (!blk || blk >= sbi->nr_blocks)
+		return NULL;
+	return arrayfs_blk_addr(sbi, blk);
+}
+
+/*
+ * Append a block, zeroed like every free block, to @dir. Blocks past
+ * the end are mapped ahead in runs of a quarter of the directory, so
+ * a directory growing next to busy file allocation still ends up in
+ * a few large extents rather than one per block.
+ */
+static void *arrayfs_dir_new_block(struct inode *dir, u32 *lblk)
+{
+	struct arrayfs_disk_inode *di = arrayfs_di(dir);
+	u32 pblk, len, run;
+	int err;
+
+	*lblk = di->size >> PAGE_SHIFT;
+	run = clamp_t(u32, *lblk / 4, 1, ARRAYFS_DIR_PREALLOC);
+	err = arrayfs_get_blocks(dir, *lblk, run, true, &pblk, &len);
+	if (err)
+		return ERR_PTR(err);
+	di->size += PAGE_SIZE;
+	i_size_write(dir, di->size);
+	return arrayfs_blk_addr(ARRAYFS_I_SB(dir), pblk);
+}
+
+static u32 arrayfs_name_hash(const struct qstr *name)
+{
+	u32 hash = full_name_hash(NULL, name->name, name->len) >> 1;
+
+	return hash == ARRAYFS_HASH_EOF ? hash - 1 : hash;
+}
+
+static inline u8 arrayfs_tag(u32 hash)
+{
+	return 0x80 | (hash & 0x7f);
+}
+
+static inline bool arrayfs_tag_used(u8 tag)
+{
+	return tag & 0x80;
+}
+
+/* Eight tags, the one for the lowest slot in the low byte */
+static inline u64 arrayfs_tag_word(struct arrayfs_dir_data *dd, unsigned int w)
+{
+	return le64_to_cpu((__force __le64)READ_ONCE(dd->tag_words[w]));
+}
+
+/*
+ * Flag the bytes of @word equal to @tag with their top bit. A byte
+ * just above a real match may be flagged falsely, but the lowest flag
+ * is always a real match.
+ */
+static inline u64 arrayfs_tag_match(u64 word, u8 tag)
+{
+	u64 x = word ^ (0x0101010101010101ULL * tag);
+
+	return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+/* The DT_* values are the S_IFMT bits shifted down */
+static inline unsigned char arrayfs_dtype(umode_t mode)
+{
+	return (mode & S_IFMT) >> 12;
+}
+
+static inline struct arrayfs_dir_rec *arrayfs_dir_rec(struct arrayfs_dir_data *dd,
+				unsigned int slot)
+{
+	return (void *)dd + dd->offs[slot];
+}
+
+/*
+ * The record of @slot, if it lies inside the record area with room
+ * for @len name bytes. Lockless readers can see a torn offset, so
+ * they check before they touch.
+ */
+static struct arrayfs_dir_rec *arrayfs_dir_rec_checked(struct arrayfs_dir_data *dd,
+				unsigned int slot, unsigned int len)
+{
+	unsigned int off = READ_ONCE(dd->offs[slot]);
+
+	if (off < ARRAYFS_DIR_HDR || off > PAGE_SIZE - ARRAYFS_REC_LEN(len))
+		return NULL;
+	return (void *)dd + off;
+}
+
+/*
+ * Returns the slot holding @name, or -1. Length and hash rule out
+ * most tag collisions before any name byte is compared.
+ */
+static int arrayfs_dir_find(struct arrayfs_dir_data *dd,
+				const struct qstr *name, u32 hash)
+{
+	struct arrayfs_dir_rec *rec;
+	unsigned int w, i;
+	u64 m;
+
+	for (w = 0; w < ARRAYFS_TAG_WORDS; w++) {
+		m = arrayfs_tag_match(arrayfs_tag_word(dd, w), arrayfs_tag(hash));
+		for (; m; m &= m - 1) {
+			i = w * 8 + __ffs64(m) / 8;
+			rec = arrayfs_dir_rec_checked(dd, i, name->len);
+			if (rec && rec->name_len == name->len &&
+					rec->hash == hash &&
+					!memcmp(rec->name, name->name, name->len))
+				return i;
+		}
+	}
+	return -1;
+}
+
+static unsigned int arrayfs_dir_free_slot(struct arrayfs_dir_data *dd)
+{
+	unsigned int w;
+	u64 m;
+
+	for (w = 0; w < ARRAYFS_TAG_WORDS; w++) {
+		m = arrayfs_tag_match(arrayfs_tag_word(dd, w), 0);
+		if (m)
+			return w * 8 + __ffs64(m) / 8;
+	}
+	return ARRAYFS_DIR_SLOTS;
+}
+
+static bool arrayfs_leaf_fits(struct arrayfs_dir_data *dd, unsigned int need)
+{
+	return arrayfs_dir_free_slot(dd) < ARRAYFS_DIR_SLOTS &&
+		PAGE_SIZE - ARRAYFS_DIR_HDR - dd->used + dd->dead >= need;
+}
+
+/*
+ * Squeeze the holes out of the record area. Records are moved in
+ * order of decreasing offset, so each only ever moves up. Reserved
+ * slots keep their space, their name_len is already set.
+ */
+static void arrayfs_leaf_compact(struct arrayfs_dir_data *dd)
+{
+	u8 order[ARRAYFS_DIR_SLOTS];
+	unsigned int i, j, n = 0, end = PAGE_SIZE, len;
+
+	for (i = 0; i < ARRAYFS_DIR_SLOTS; i++) {
+		if (!dd->tags[i])
+			continue;
+		for (j = n++; j && dd->offs[order[j - 1]] < dd->offs[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (i = 0; i < n; i++) {
+		len = ARRAYFS_REC_LEN(arrayfs_dir_rec(dd, order[i])->name_len);
+		end -= len;
+		memmove((void *)dd + end, arrayfs_dir_rec(dd, order[i]), len);
+		dd->offs[order[i]] = end;
+	}
+	dd->used = PAGE_SIZE - end;
+	dd->dead = 0;
+}
+
+/* Carve a record for @len name bytes out of the free area for @slot */
+static void arrayfs_leaf_take(struct arrayfs_dir_data *dd, unsigned int slot,
+				unsigned int len)
+{
+	dd->used += ARRAYFS_REC_LEN(len);
+	dd->offs[slot] = PAGE_SIZE - dd->used;
+	arrayfs_dir_rec(dd, slot)->name_len = len;
+}
+
+/*
+ * Fill a reserved slot. The tag goes in last, lockless readers only
+ * look at entries whose tag is set.
+ */
+static void arrayfs_dir_insert(struct arrayfs_dir_data *dd, unsigned long index,
+				const struct qstr *name, u32 hash,
+				unsigned long ino, unsigned char type)
+{
+	struct arrayfs_dir_rec *rec = arrayfs_dir_rec(dd, index);
+
+	rec->ino = ino;
+	rec->hash = hash;
+	rec->name_len = name->len;
+	rec->file_type = type;
+	memcpy(rec->name, name->name, name->len);
+	smp_wmb();
+	WRITE_ONCE(dd->tags[index], arrayfs_tag(hash));
+}
+
+/* Index of the last of the first @count entries whose hash is <= @hash */
+static unsigned int arrayfs_dx_search(struct arrayfs_dx_node *node,
+				unsigned int count, u32 hash)
+{
+	unsigned int lo = 1, hi = count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->entries[mid].hash <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* Whether @blk can't take an index entry, or a leaf a record of @need */
+static bool arrayfs_dx_full(void *blk, unsigned int need)
+{
+	struct arrayfs_dx_node *node = blk;
+
+	if (node->level)
+		return node->count == ARRAYFS_DX_LIMIT;
+	return !arrayfs_leaf_fits(blk, need);
+}
+
+/*
+ * Walk down to the leaf covering @hash. If @next is given, it gets the
+ * first hash of the following leaf, or ARRAYFS_HASH_EOF.
+ */
+static struct arrayfs_dir_data *arrayfs_dx_leaf(struct inode *dir, u32 hash,
+				u32 *next)
+{
+	struct arrayfs_dx_node *node = arrayfs_dir_block(dir, 0);
+	unsigned int i, count, depth = 0;
+
+	if (next)
+		*next = ARRAYFS_HASH_EOF;
+	while (node && READ_ONCE(node->level)) {
+		count = READ_ONCE(node->count);
+		if (!count || count > ARRAYFS_DX_LIMIT ||
+				++depth > ARRAYFS_DX_MAX_DEPTH)
+			return NULL;
+		i = arrayfs_dx_search(node, count, hash);
+		if (next && i + 1 < count)
+			*next = node->entries[i + 1].hash;
+		node = arrayfs_dir_block(dir, node->entries[i].lblk);
+	}
+	return (struct arrayfs_dir_data *)node;
+}
+
+static int arrayfs_cmp_hash(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Move the upper half of a full leaf, by hash, to a new block. Equal
+ * hashes stay together, so every hash lives in exactly one leaf.
+ * Returns the first hash of the new leaf in *split.
+ */
+static int arrayfs_split_leaf(struct inode *dir, struct arrayfs_dir_data *leaf,
+				u32 *split, u32 *lblk)
+{
+	u32 hashes[ARRAYFS_DIR_SLOTS];
+	struct arrayfs_dir_data *new;
+	struct arrayfs_dir_rec *rec;
+	unsigned int i, n = 0, len;
+
+	for (i = 0; i < ARRAYFS_DIR_SLOTS; i++)
+		if (arrayfs_tag_used(leaf->tags[i]))
+			hashes[n++] = arrayfs_dir_rec(leaf, i)->hash;
+	if (n < 2)
+		return -ENOSPC;
+	sort(hashes, n, sizeof(u32), arrayfs_cmp_hash, NULL);
+
+	for (i = n / 2; i < n && hashes[i] == hashes[i - 1]; i++)
+		;
+	if (i == n) {
+		for (i = n / 2; i && hashes[i] == hashes[i - 1]; i--)
+			;
+		if (!i)
+			return -ENOSPC;
+	}
+	*split = hashes[i];
+
+	new = arrayfs_dir_new_block(dir, lblk);
+	if (IS_ERR(new))
+		return PTR_ERR(new);
+
+	/* Entries keep their slot numbers */
+	for (i = 0; i < ARRAYFS_DIR_SLOTS; i++) {
+		if (!arrayfs_tag_used(leaf->tags[i]))
+			continue;
+		rec = arrayfs_dir_rec(leaf, i);
+		if (rec->hash < *split)
+			continue;
+		len = ARRAYFS_REC_LEN(rec->name_len);
+		new->used += len;
+		new->offs[i] = PAGE_SIZE - new->used;
+		memcpy(arrayfs_dir_rec(new, i), rec, len);
+		new->tags[i] = leaf->tags[i];
+		leaf->tags[i] = 0;
+		leaf->offs[i] = 0;
+		leaf->dead += len;
+	}
+	arrayfs_leaf_compact(leaf);
+	return 0;
+}
+
+static int arrayfs_split_index(struct inode *dir, struct arrayfs_dx_node *node,
+				u32 *split, u32 *lblk)
+{
+	struct arrayfs_dx_node *new;
+	unsigned int mid = node->count / 2;
+
+	new = arrayfs_dir_new_block(dir, lblk);
+	if (IS_ERR(new))
+		return PTR_ERR(new);
+
+	new->level = node->level;
+	new->count = node->count - mid;
+	memcpy(new->entries, &node->entries[mid],
+			new->count * sizeof(struct arrayfs_dx_entry));
+	memset(&node->entries[mid], 0,
+			new->count * sizeof(struct arrayfs_dx_entry));
+	node->count = mid;
+	*split = new->entries[0].hash;
+	return 0;
+}
+
+/* Move the root's contents to a new block and index that from the root */
+static int arrayfs_dx_grow_root(struct inode *dir, struct arrayfs_dx_node *root)
+{
+	struct arrayfs_dx_node *new;
+	u32 lblk;
+
+	if (root->level >= ARRAYFS_DX_MAX_DEPTH)
+		return -ENOSPC;
+	new = arrayfs_dir_new_block(dir, &lblk);
+	if (IS_ERR(new))
+		return PTR_ERR(new);
+
+	memcpy(new, root, PAGE_SIZE);
+	memset(root, 0, PAGE_SIZE);
+	root->level = new->level + 1;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].lblk = lblk;
+	return 0;
+}
+
+static void arrayfs_dx_insert(struct arrayfs_dx_node *node, unsigned int pos,
+				u32 hash, u32 lblk)
+{
+	memmove(&node->entries[pos + 2], &node->entries[pos + 1],
+		(node->count - pos - 1) * sizeof(struct arrayfs_dx_entry));
+	node->entries[pos + 1].hash = hash;
+	node->entries[pos + 1].lblk = lblk;
+	node->count++;
+}
+
+/*
+ * Find the leaf a new record of @need bytes with @hash goes in. Full
+ * blocks are split on the way down, so every split finds room for its
+ * index entry in the parent. Splits go by entry count, so with long
+ * names the leaf we end up at may still be short of room; the caller
+ * just tries again.
+ */
+static struct arrayfs_dir_data *arrayfs_dx_insert_leaf(struct inode *dir,
+				u32 hash, unsigned int need)
+{
+	struct arrayfs_dx_node *node = arrayfs_dir_block(dir, 0), *child;
+	unsigned int i;
+	u32 split, lblk;
+	int err;
+
+	if (!node)
+		return ERR_PTR(-EIO);
+	if (arrayfs_dx_full(node, need)) {
+		err = arrayfs_dx_grow_root(dir, node);
+		if (err)
+			return ERR_PTR(err);
+	}
+
+	while (node->level) {
+		i = arrayfs_dx_search(node, node->count, hash);
+		child = arrayfs_dir_block(dir, node->entries[i].lblk);
+		if (!child)
+			return ERR_PTR(-EIO);
+		if (arrayfs_dx_full(child, need)) {
+			if (child->level)
+				err = arrayfs_split_index(dir, child, &split, &lblk);
+			else
+				err = arrayfs_split_leaf(dir,
+					(struct arrayfs_dir_data *)child,
+					&split, &lblk);
+			if (err)
+				return ERR_PTR(err);
+			arrayfs_dx_insert(node, i, split, lblk);
+			if (hash >= split) {
+				child = arrayfs_dir_block(dir, lblk);
+				if (!child)
+					return ERR_PTR(-EIO);
+			}
+		}
+		node = child;
+	}
+	return (struct arrayfs_dir_data *)node;
+}
+
+static u32 arrayfs_bloom_bit(struct arrayfs_bloom *bloom, u32 hash,
+				unsigned int i)
+{
+	/* Double hashing, the step must be odd to reach every bit */
+	u32 step = hash_32(hash, 32) | 1;
+
+	return (hash + i * step) & ((1U << bloom->shift) - 1);
+}
+
+/* False means @hash is definitely not in the directory */
+static bool arrayfs_bloom_test(struct arrayfs_bloom *bloom, u32 hash)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYFS_BLOOM_HASHES; i++)
+		if (!test_bit(arrayfs_bloom_bit(bloom, hash, i), bloom->bits))
+			return false;
+	return true;
+}
+
+static void arrayfs_bloom_add(struct arrayfs_bloom *bloom, u32 hash)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYFS_BLOOM_HASHES; i++)
+		set_bit(arrayfs_bloom_bit(bloom, hash, i), bloom->bits);
+	atomic_inc(&bloom->nr_added);
+}
+
+static bool arrayfs_bloom_stale(struct arrayfs_bloom *bloom)
+{
+	int added;
+
+	if (!bloom)
+		return false;
+	added = atomic_read(&bloom->nr_added);
+	return added > (1 << bloom->shift) / 8 ||
+		atomic_read(&bloom->nr_removed) > added / 4;
+}
+
+static void arrayfs_bloom_free_rcu(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct arrayfs_bloom, rcu));
+}
+
+/* Add every entry of @dir to @bloom */
+static void arrayfs_bloom_fill(struct inode *dir, struct arrayfs_bloom *bloom)
+{
+	u32 lblk, nr = arrayfs_di(dir)->size >> PAGE_SHIFT;
+	struct arrayfs_dir_data *leaf;
+	unsigned int i;
+
+	for (lblk = 0; lblk < nr; lblk++) {
+		leaf = arrayfs_dir_block(dir, lblk);
+		if (!leaf || leaf->level)
+			continue;
+		for (i = 0; i < ARRAYFS_DIR_SLOTS; i++) {
+			if (arrayfs_tag_used(leaf->tags[i]))
+				arrayfs_bloom_add(bloom,
+						arrayfs_dir_rec(leaf, i)->hash);
+		}
+	}
+}
+
+/*
+ * Build a filter sized for @dir's blocks in one pass over them and
+ * swap it in. The caller holds i_dir_sem exclusive, or has the inode
+ * to itself. If there's no memory we go on without a filter until the
+ * next try.
+ */
+static void arrayfs_bloom_rebuild(struct inode *dir)
+{
+	struct arrayfs_inode *ai = ARRAYFS_I(dir);
+	struct arrayfs_bloom *bloom, *old;
+	unsigned long slots = (arrayfs_di(dir)->size >> PAGE_SHIFT) *
+					ARRAYFS_DIR_SLOTS;
+	unsigned int shift = ARRAYFS_BLOOM_MIN_SHIFT;
+
+	while ((1UL << shift) < slots * 8)
+		shift++;
+	bloom = kvzalloc(struct_size(bloom, bits, BITS_TO_LONGS(1U << shift)),
+				GFP_KERNEL);
+	if (bloom) {
+		bloom->shift = shift;
+		arrayfs_bloom_fill(dir, bloom);
+	}
+
+	old = rcu_dereference_protected(ai->i_bloom, true);
+	rcu_assign_pointer(ai->i_bloom, bloom);
+	if (old)
+		call_rcu(&old->rcu, arrayfs_bloom_free_rcu);
+}
+
+/* Build @dir's filter if it has none yet, or rebuild it if stale */
+static void arrayfs_bloom_refresh(struct inode *dir, bool build)
+{
+	struct arrayfs_inode *ai = ARRAYFS_I(dir);
+	struct arrayfs_bloom *bloom;
+
+	down_write(&ai->i_dir_sem);
+	bloom = rcu_dereference_protected(ai->i_bloom,
+				lockdep_is_held(&ai->i_dir_sem));
+	if (bloom ? arrayfs_bloom_stale(bloom) : build)
+		arrayfs_bloom_rebuild(dir);
+	up_write(&ai->i_dir_sem);
+}
+
+static struct arrayfs_leaf_lock *arrayfs_leaf_lock(struct inode *dir,
+				struct arrayfs_dir_data *leaf)
+{
+	return &ARRAYFS_I_SB(dir)->dir_locks[hash_ptr(leaf,
+					ARRAYFS_DIR_LOCK_BITS)];
+}
+
+/*
+ * Lockless walks of a directory's index check i_dir_seq. A split may
+ * sleep allocating blocks inside its write section, so a walker that
+ * finds one in progress waits for it on i_dir_sem instead of spinning,
+ * and then walks under the lock. arrayfs_dir_walk_end drops the lock
+ * if it was taken and says whether the walk has to be redone.
+ */
+static unsigned int arrayfs_dir_walk_begin(struct arrayfs_inode *ai,
+				bool *locked)
+{
+	unsigned int seq = raw_read_seqcount(&ai->i_dir_seq);
+
+	*locked = seq & 1;
+	if (*locked)
+		down_read(&ai->i_dir_sem);
+	return seq;
+}
+
+static bool arrayfs_dir_walk_end(struct arrayfs_inode *ai, unsigned int seq,
+				bool locked)
+{
+	if (locked) {
+		up_read(&ai->i_dir_sem);
+		return false;
+	}
+	return read_seqcount_retry(&ai->i_dir_seq, seq);
+}
+
+/*
+ * Reserve a slot and @len name bytes for a new entry with @hash.
+ * Creates in different leaves only share i_dir_sem; only a full leaf
+ * makes us take it exclusive to split. On success i_dir_sem is held
+ * shared until arrayfs_dir_commit or arrayfs_dir_cancel, so the leaf
+ * stays put. A reserved slot's tag matches no hash and readdir skips
+ * it.
+ */
+static struct arrayfs_dir_data *arrayfs_dir_reserve(struct inode *dir,
+				u32 hash, unsigned int len, unsigned int *slot)
+{
+	struct arrayfs_inode *ai = ARRAYFS_I(dir);
+	struct arrayfs_dir_data *leaf;
+	struct arrayfs_leaf_lock *ll;
+	unsigned int need = ARRAYFS_REC_LEN(len);
+	unsigned int i = ARRAYFS_DIR_SLOTS;
+
+	down_read(&ai->i_dir_sem);
+	leaf = arrayfs_dx_leaf(dir, hash, NULL);
+	if (!leaf) {
+		up_read(&ai->i_dir_sem);
+		return ERR_PTR(-EIO);
+	}
+	ll = arrayfs_leaf_lock(dir, leaf);
+	spin_lock(&ll->lock);
+	if (arrayfs_leaf_fits(leaf, need)) {
+		i = arrayfs_dir_free_slot(leaf);
+		if (PAGE_SIZE - ARRAYFS_DIR_HDR - leaf->used < need) {
+			write_seqcount_begin(&ll->seq);
+			arrayfs_leaf_compact(leaf);
+			write_seqcount_end(&ll->seq);
+		}
+		arrayfs_leaf_take(leaf, i, len);
+		WRITE_ONCE(leaf->tags[i], ARRAYFS_TAG_RESERVED);
+	}
+	spin_unlock(&ll->lock);
+	if (i < ARRAYFS_DIR_SLOTS) {
+		*slot = i;
+		return leaf;
+	}
+	up_read(&ai->i_dir_sem);
+
+	down_write(&ai->i_dir_sem);
+	write_seqcount_begin(&ai->i_dir_seq);
+	do {
+		leaf = arrayfs_dx_insert_leaf(dir, hash, need);
+	} while (!IS_ERR(leaf) && !arrayfs_leaf_fits(leaf, need));
+	if (!IS_ERR(leaf) &&
+			PAGE_SIZE - ARRAYFS_DIR_HDR - leaf->used < need)
+		arrayfs_leaf_compact(leaf);
+	write_seqcount_end(&ai->i_dir_seq);
+	if (IS_ERR(leaf)) {
+		up_write(&ai->i_dir_sem);
+		return leaf;
+	}
+	/* The directory grew, see if the filter should grow with it */
+	if (arrayfs_bloom_stale(rcu_dereference_protected(ai->i_bloom,
+				lockdep_is_held(&ai->i_dir_sem))))
+		arrayfs_bloom_rebuild(dir);
+	i = arrayfs_dir_free_slot(leaf);
+	arrayfs_leaf_take(leaf, i, len);
+	leaf->tags[i] = ARRAYFS_TAG_RESERVED;
+	downgrade_write(&ai->i_dir_sem);
+	*slot = i;
+	return leaf;
+}
 
-/* These are in-memory inodes. So we don't need to allocate them dynamically. */
-struct arrayfs_inode memory_inodes[ARRAYFS_NR_INODES];
+static void arrayfs_dir_commit(struct inode *dir, struct arrayfs_dir_data *leaf,
+				unsigned int slot, const struct qstr *name,
+				u32 hash, struct inode *inode)
+{
+	struct arrayfs_inode *ai = ARRAYFS_I(dir);
+	struct arrayfs_leaf_lock *ll = arrayfs_leaf_lock(dir, leaf);
+	struct arrayfs_bloom *bloom;
+	bool stale;
+
+	/* Into the filter before the entry becomes visible */
+	bloom = rcu_dereference_protected(ai->i_bloom,
+				lockdep_is_held(&ai->i_dir_sem));
+	if (bloom)
+		arrayfs_bloom_add(bloom, hash);
+	stale = arrayfs_bloom_stale(bloom);
+
+	spin_lock(&ll->lock);
+	write_seqcount_begin(&ll->seq);
+	arrayfs_dir_insert(leaf, slot, name, hash, inode->i_ino,
+				arrayfs_dtype(inode->i_mode));
+	write_seqcount_end(&ll->seq);
+	spin_unlock(&ll->lock);
+	up_read(&ai->i_dir_sem);
+
+	if (stale)
+		arrayfs_bloom_refresh(dir, false);
+}
 
-/* These are data storage */
-struct arrayfs_sb global_sb;
-struct arrayfs_disk_inode global_inodes[ARRAYFS_NR_INODES];
-char global_data[ARRAYFS_NR_INODES][ARRAYFS_NR_PGS_PER_FILE][PAGE_SIZE];
-unsigned long disk_inode_bm;
+static void arrayfs_dir_cancel(struct inode *dir, struct arrayfs_dir_data *leaf,
+				unsigned int slot)
+{
+	struct arrayfs_leaf_lock *ll = arrayfs_leaf_lock(dir, leaf);
+
+	/* The slot was never filled in, readers don't care */
+	spin_lock(&ll->lock);
+	WRITE_ONCE(leaf->tags[slot], 0);
+	leaf->dead += ARRAYFS_REC_LEN(arrayfs_dir_rec(leaf, slot)->name_len);
+	spin_unlock(&ll->lock);
+	up_read(&ARRAYFS_I(dir)->i_dir_sem);
+}
 
-static inline struct arrayfs_inode *ARRAYFS_I(struct inode *inode)
+/*
+ * Take the entry for @name out of @dir. Clearing the tag hides it from
+ * lookups; its record bytes turn dead and go at the next compaction.
+ * Once enough names are gone the Bloom filter is rebuilt without them.
+ */
+static int arrayfs_dir_remove(struct inode *dir, const struct qstr *name,
+				u32 hash)
 {
-	return container_of(inode, struct arrayfs_inode, vfs_inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(dir);
+	struct arrayfs_dir_data *leaf;
+	struct arrayfs_leaf_lock *ll;
+	struct arrayfs_bloom *bloom;
+	bool stale;
+	int slot;
+
+	down_read(&ai->i_dir_sem);
+	leaf = arrayfs_dx_leaf(dir, hash, NULL);
+	if (!leaf) {
+		up_read(&ai->i_dir_sem);
+		return -EIO;
+	}
+	ll = arrayfs_leaf_lock(dir, leaf);
+	spin_lock(&ll->lock);
+	slot = arrayfs_dir_find(leaf, name, hash);
+	if (slot >= 0) {
+		write_seqcount_begin(&ll->seq);
+		WRITE_ONCE(leaf->tags[slot], 0);
+		leaf->dead += ARRAYFS_REC_LEN(arrayfs_dir_rec(leaf,
+						slot)->name_len);
+		write_seqcount_end(&ll->seq);
+	}
+	spin_unlock(&ll->lock);
+	if (slot < 0) {
+		up_read(&ai->i_dir_sem);
+		return -ENOENT;
+	}
+
+	bloom = rcu_dereference_protected(ai->i_bloom,
+				lockdep_is_held(&ai->i_dir_sem));
+	if (bloom)
+		atomic_inc(&bloom->nr_removed);
+	stale = arrayfs_bloom_stale(bloom);
+	up_read(&ai->i_dir_sem);
+
+	if (stale)
+		arrayfs_bloom_refresh(dir, false);
+	return 0;
 }
 
-static inline struct arrayfs_sb *ARRAYFS_I_SB(struct inode *inode)
+/*
+ * Copy the attributes kept in the disk inode from @inode. A directory's
+ * size is maintained by arrayfs_dir_new_block itself.
+ */
+static void arrayfs_fill_disk_inode(struct arrayfs_disk_inode *di,
+				struct inode *inode)
 {
-	return &global_sb;
+	di->mode = inode->i_mode;
+	di->nlink = inode->i_nlink;
+	di->uid = i_uid_read(inode);
+	di->gid = i_gid_read(inode);
+	if (!S_ISDIR(inode->i_mode))
+		di->size = i_size_read(inode);
+	di->atime = timespec64_to_ns(&inode->i_atime);
+	di->mtime = timespec64_to_ns(&inode->i_mtime);
+	di->ctime = timespec64_to_ns(&inode->i_ctime);
 }
 
 static struct inode *arrayfs_new_inode(struct inode *dir, umode_t mode)
@@ -97,28 +1787,24 @@ static struct inode *arrayfs_new_inode(struct inode *dir, umode_t mode)
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
 
-	spin_lock(&sbi->cp_lock);
-	ino = find_first_zero_bit(&disk_inode_bm, ARRAYFS_NR_INODES);
-	if (ino == ARRAYFS_NR_INODES) {
-		spin_unlock(&sbi->cp_lock);
+	ino = arrayfs_alloc_ino(sbi);
+	if (ino >= sbi->nr_inodes) {
 		err = -ENOSPC;
 		goto fail;
 	}
-	set_bit(ino, &disk_inode_bm);
-	spin_unlock(&sbi->cp_lock);
 
 	pr_notice("%s, allocate new disk inode, pa=%lu\n",
 					__func__, ino);
-	di = &global_inodes[ino];
-	di->mode = mode;
-	di->size = 0;
-
 	inode_init_owner(inode, dir, mode);
 
 	inode->i_ino = ino;
 	inode->i_mtime = inode->i_atime = inode->i_ctime =
 			current_time(inode);
 
+	di = &sbi->disk_inodes[ino];
+	memset(di, 0, sizeof(*di));
+	arrayfs_fill_disk_inode(di, inode);
+
 	err = insert_inode_locked(inode);
 	if (err) {
 		err = -EINVAL;
@@ -127,9 +1813,7 @@ static struct inode *arrayfs_new_inode(struct inode *dir, umode_t mode)
 
 	return inode;
 failfree:
-	spin_lock(&sbi->cp_lock);
-	clear_bit(ino, &disk_inode_bm);
-	spin_unlock(&sbi->cp_lock);
+	arrayfs_free_ino(sbi, ino);
 fail:
 	iput(inode);
 	return ERR_PTR(err);
@@ -139,101 +1823,200 @@ fail:
 static int arrayfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 						bool excl)
 {
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(dir);
 	struct inode *inode;
 	unsigned long ino = 0;
 	unsigned long dirino = dir->i_ino;
 	struct arrayfs_dir_data *dir_data;
-	unsigned long index;
+	unsigned int index;
+	u32 hash;
 
-	if (dirino >= ARRAYFS_NR_INODES)
+	if (dirino >= sbi->nr_inodes)
 		return -EINVAL;
+	if (dentry->d_name.len > ARRAYFS_NAME_LEN)
+		return -ENAMETOOLONG;
 
-	//TODO: competition here
-	dir_data = (struct arrayfs_dir_data *)global_data[dirino][0];
-	index = find_first_zero_bit(&dir_data->bitmap, 64);
-	if (index == 64) {
-		pr_err("%s, not enough space for dir. ino = %lu\n",
+	hash = arrayfs_name_hash(&dentry->d_name);
+	dir_data = arrayfs_dir_reserve(dir, hash, dentry->d_name.len, &index);
+	if (IS_ERR(dir_data)) {
+		pr_err("%s, no room in dir. ino = %lu\n",
 					__func__, dirino);
-		return -ENOSPC;
+		return PTR_ERR(dir_data);
 	}
-	set_bit(index, &dir_data->bitmap);
 
 	inode = arrayfs_new_inode(dir, mode);
-	if (IS_ERR(inode))
+	if (IS_ERR(inode)) {
+		arrayfs_dir_cancel(dir, dir_data, index);
 		return PTR_ERR(inode);
+	}
 
-	inode->i_op = &arrayfs_file_iops;
-	inode->i_fop = &arrayfs_file_operations;
-	inode->i_mapping->a_ops = &arrayfs_file_aops;
+	arrayfs_set_file_ops(inode);
 	ino = inode->i_ino;
 
 	d_instantiate(dentry, inode);
+	if (test_opt(sbi, PAGECACHE))
+		dget(dentry);	/* The inode holds the data, pin it */
 	unlock_new_inode(inode);
+	arrayfs_publish_inode(inode);
 
-	strcpy(dir_data->entries[index].name, dentry->d_name.name);
-	dir_data->entries[index].ino = ino;
+	arrayfs_dir_commit(dir, dir_data, index, &dentry->d_name, hash, inode);
 
 	return 0;
 }
 
 static int arrayfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(dir);
 	struct inode *inode;
 	unsigned long ino = 0;
 	unsigned long dirino = dir->i_ino;
 	struct arrayfs_dir_data *dir_data;
-	unsigned long index;
+	struct arrayfs_disk_inode *di;
+	unsigned int index;
+	u32 hash, blk, got;
 
-	if (dirino >= ARRAYFS_NR_INODES)
+	if (dirino >= sbi->nr_inodes)
 		return -EINVAL;
+	if (dentry->d_name.len > ARRAYFS_NAME_LEN)
+		return -ENAMETOOLONG;
 
-	//TODO: competition here
-	dir_data = (struct arrayfs_dir_data *)global_data[dirino][0];
-	index = find_first_zero_bit(&dir_data->bitmap, 64);
-	if (index == 64) {
-		pr_err("%s, not enough space for dir. ino = %lu\n",
+	hash = arrayfs_name_hash(&dentry->d_name);
+	dir_data = arrayfs_dir_reserve(dir, hash, dentry->d_name.len, &index);
+	if (IS_ERR(dir_data)) {
+		pr_err("%s, no room in dir. ino = %lu\n",
 					__func__, dirino);
+		return PTR_ERR(dir_data);
+	}
+
+	/* The new directory's entry block */
+	blk = arrayfs_alloc_blocks(sbi, 0, 1, &got);
+	if (!blk) {
+		arrayfs_dir_cancel(dir, dir_data, index);
 		return -ENOSPC;
 	}
-	set_bit(index, &dir_data->bitmap);
 
 	inode = arrayfs_new_inode(dir, mode);
-	if (IS_ERR(inode))
+	if (IS_ERR(inode)) {
+		arrayfs_free_blocks(sbi, blk, 1);
+		arrayfs_dir_cancel(dir, dir_data, index);
 		return PTR_ERR(inode);
+	}
+
+	di = arrayfs_di(inode);
+	di->extent.lblk = 0;
+	di->extent.pblk = blk;
+	di->extent.len = 1;
+	di->nr_extents = 1;
+	di->size = PAGE_SIZE;
+	inode->i_size = PAGE_SIZE;
+	inc_nlink(inode);	/* "." */
+	di->nlink = inode->i_nlink;
+	arrayfs_bloom_rebuild(inode);
 
 	inode->i_op = &arrayfs_dir_iops;
 	inode->i_fop = &arrayfs_dir_operations;
 	ino = inode->i_ino;
 
 	d_instantiate(dentry, inode);
+	if (test_opt(sbi, PAGECACHE))
+		dget(dentry);	/* Keep the tree in core, see arrayfs_umount */
 	unlock_new_inode(inode);
+	arrayfs_publish_inode(inode);
 
-	strcpy(dir_data->entries[index].name, dentry->d_name.name);
-	dir_data->entries[index].ino = ino;
+	arrayfs_dir_commit(dir, dir_data, index, &dentry->d_name, hash, inode);
+	inc_nlink(dir);		/* ".." */
+	mark_inode_dirty(dir);
 
 	return 0;
 }
 
-static int str_same(const char *a, const char *b)
+/* Common tail of unlink and rmdir, once the entry is gone */
+static void arrayfs_entry_removed(struct inode *dir, struct dentry *dentry)
 {
-	int i;
+	struct inode *inode = d_inode(dentry);
 
-	for (i = 0; i < 32; i++) {
-		if (a[i] != b[i])
-			return 0;
-		if (!a[i])
-			return 1;
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
+	mark_inode_dirty(inode);
+	mark_inode_dirty(dir);
+	if (test_opt(ARRAYFS_I_SB(dir), PAGECACHE))
+		dput(dentry);	/* The pin taken at create time */
+}
+
+/*
+ * Only the entry goes here. Freeing the inode's blocks and number is
+ * left to the reclaim worker once the last reference is dropped, see
+ * arrayfs_evict_inode.
+ */
+static int arrayfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	int err;
+
+	err = arrayfs_dir_remove(dir, &dentry->d_name,
+				arrayfs_name_hash(&dentry->d_name));
+	if (err)
+		return err;
+	drop_nlink(d_inode(dentry));
+	arrayfs_entry_removed(dir, dentry);
+	return 0;
+}
+
+/* Whether @dir has no entries. Stops at the first used tag found */
+static bool arrayfs_dir_empty(struct inode *dir)
+{
+	u32 lblk, nr = arrayfs_di(dir)->size >> PAGE_SHIFT;
+	struct arrayfs_dir_data *leaf;
+	unsigned int w;
+
+	for (lblk = 0; lblk < nr; lblk++) {
+		leaf = arrayfs_dir_block(dir, lblk);
+		if (!leaf || leaf->level)
+			continue;
+		for (w = 0; w < ARRAYFS_TAG_WORDS; w++)
+			if (arrayfs_tag_word(leaf, w) & 0x8080808080808080ULL)
+				return false;
 	}
-	return 1;
+	return true;
+}
+
+static int arrayfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	bool empty;
+	int err;
+
+	/* The VFS holds the victim's lock, nothing is being created in it */
+	down_read(&ai->i_dir_sem);
+	empty = arrayfs_dir_empty(inode);
+	up_read(&ai->i_dir_sem);
+	if (!empty)
+		return -ENOTEMPTY;
+
+	err = arrayfs_dir_remove(dir, &dentry->d_name,
+				arrayfs_name_hash(&dentry->d_name));
+	if (err)
+		return err;
+	clear_nlink(inode);
+	drop_nlink(dir);
+	arrayfs_entry_removed(dir, dentry);
+	return 0;
 }
 
 static struct dentry *arrayfs_lookup(struct inode *dir, struct dentry *dentry,
 		unsigned int flags)
 {
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(dir);
 	unsigned long dir_ino = dir->i_ino;
 	unsigned long child_ino;
+	struct arrayfs_inode *ai = ARRAYFS_I(dir);
 	struct arrayfs_dir_data *dirdata;
-	int index = -1;
+	struct arrayfs_dir_rec *rec;
+	struct arrayfs_leaf_lock *ll;
+	struct arrayfs_bloom *bloom;
+	bool have_bloom, locked, stale;
+	unsigned int dseq, lseq;
+	int index;
+	u32 hash;
 	struct inode *child_inode = NULL;
 	struct dentry *newdentry;
 
@@ -241,30 +2024,64 @@ static struct dentry *arrayfs_lookup(struct inode *dir, struct dentry *dentry,
 				__func__, dentry->d_name.name);
 
 
-	if (dir_ino >= ARRAYFS_NR_INODES)
+	if (dir_ino >= sbi->nr_inodes)
 		return ERR_PTR(-EINVAL);
+	if (dentry->d_name.len > ARRAYFS_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
 
-	dirdata = (struct arrayfs_dir_data *)global_data[dir_ino][0];
-
-	for (;;) {
-		index = find_next_bit(&dirdata->bitmap, 64, index + 1);
-		if (index >= 64)
-			break;
+	hash = arrayfs_name_hash(&dentry->d_name);
 
-		if (str_same(dirdata->entries[index].name, dentry->d_name.name)) {
-			//found
-			child_ino = dirdata->entries[index].ino;
-			child_inode = arrayfs_iget(ARRAYFS_I_SB(dir)->sb, child_ino);
-			if (IS_ERR(child_inode)) {
-				pr_err("%s, Can't get inode %lu\n",
-							__func__, child_ino);
-				return ERR_PTR(-EIO);
-			}
-			goto outSplice;
+	rcu_read_lock();
+	bloom = rcu_dereference(ai->i_bloom);
+	if (bloom && !arrayfs_bloom_test(bloom, hash)) {
+		rcu_read_unlock();
+		goto out;
+	}
+	have_bloom = bloom != NULL;
+	rcu_read_unlock();
+retry:
+	/* Splits may sleep, so wait for them on i_dir_sem outside RCU */
+	dseq = arrayfs_dir_walk_begin(ai, &locked);
+	rcu_read_lock();
+	dirdata = arrayfs_dx_leaf(dir, hash, NULL);
+	if (!dirdata) {
+		rcu_read_unlock();
+		if (arrayfs_dir_walk_end(ai, dseq, locked))
+			goto retry;
+		return ERR_PTR(-EIO);
+	}
+	ll = arrayfs_leaf_lock(dir, dirdata);
+	lseq = read_seqcount_begin(&ll->seq);
+	index = arrayfs_dir_find(dirdata, &dentry->d_name, hash);
+	if (index >= 0) {
+		rec = arrayfs_dir_rec_checked(dirdata, index, 0);
+		child_ino = rec ? READ_ONCE(rec->ino) : 0;
+	}
+	rcu_read_unlock();
+	stale = arrayfs_dir_walk_end(ai, dseq, locked);
+	if (read_seqcount_retry(&ll->seq, lseq) || stale)
+		goto retry;
+
+	if (index >= 0) {
+		child_inode = arrayfs_iget(sbi->sb, child_ino);
+		if (IS_ERR(child_inode)) {
+			pr_err("%s, Can't get inode %lu\n",
+						__func__, child_ino);
+			return ERR_PTR(-EIO);
 		}
+		/*
+		 * Names found right after a readdir that weren't in the
+		 * dcache: likely stat() of what readdir returned. Enough
+		 * of them and the next readdir pass brings them in.
+		 */
+		if (time_before(jiffies, READ_ONCE(ai->i_readdir_time) +
+					ARRAYFS_PRIME_WINDOW))
+			atomic_inc(&ai->i_prime_hits);
+	} else if (!have_bloom) {
+		/* Misses are worth a filter, build it now */
+		arrayfs_bloom_refresh(dir, true);
 	}
-	//not found
-outSplice:
+out:
 	newdentry = d_splice_alias(child_inode, dentry);
 	return newdentry;
 }
@@ -274,99 +2091,740 @@ const struct inode_operations arrayfs_dir_iops = {
 	.create 	= arrayfs_create,
 	.mkdir		= arrayfs_mkdir,
 	.lookup 	= arrayfs_lookup,
+	.unlink		= arrayfs_unlink,
+	.rmdir		= arrayfs_rmdir,
 };
 
-const struct inode_operations arrayfs_file_iops = {
+static int arrayfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	loff_t old_size = i_size_read(inode);
+	int err;
+
+	err = setattr_prepare(dentry, attr);
+	if (err)
+		return err;
+
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != old_size) {
+		/* No fault may map or allocate a block while we cut */
+		down_write(&ARRAYFS_I(inode)->i_mmap_sem);
+		/* Unmaps and drops the page cache past the new size */
+		truncate_setsize(inode, attr->ia_size);
+		/* In pagecache mode the pages were all there was */
+		if (!test_opt(sbi, PAGECACHE) && attr->ia_size < old_size)
+			arrayfs_truncate_blocks(inode, attr->ia_size);
+		up_write(&ARRAYFS_I(inode)->i_mmap_sem);
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
 
+const struct inode_operations arrayfs_file_iops = {
+	.setattr	= arrayfs_setattr,
 };
 
+/*
+ * Instantiate the dentry and inode for a child readdir is about to
+ * return, as the lookup that usually follows would. Anything already
+ * cached, or any failure, is left alone; this is only a hint.
+ */
+static void arrayfs_prime_dcache(struct dentry *parent, const char *name,
+				unsigned int len, unsigned long ino)
+{
+	struct qstr filename = QSTR_INIT(name, len);
+	DECLARE_WAIT_QUEUE_HEAD_ONSTACK(wq);
+	struct dentry *dentry, *alias;
+	struct inode *inode;
+
+	filename.hash = full_name_hash(parent, filename.name, filename.len);
+	dentry = d_lookup(parent, &filename);
+	if (!dentry) {
+		dentry = d_alloc_parallel(parent, &filename, &wq);
+		if (IS_ERR(dentry))
+			return;
+	}
+	if (!d_in_lookup(dentry))
+		goto out;
+
+	inode = arrayfs_iget(parent->d_sb, ino);
+	if (IS_ERR(inode)) {
+		d_lookup_done(dentry);
+		goto out;
+	}
+	alias = d_splice_alias(inode, dentry);
+	d_lookup_done(dentry);
+	if (alias) {
+		if (IS_ERR(alias))
+			goto out;
+		dput(dentry);
+		dentry = alias;
+	}
+out:
+	dput(dentry);
+}
+
+/*
+ * The readdir cookie is the hash of the next entry to return, so it
+ * stays valid however the tree is split meanwhile. Within a leaf the
+ * entries are returned in hash order. Each leaf is copied out without
+ * locking, retrying if a writer got in the way, and emitted from the
+ * copy since dir_emit may fault.
+ *
+ * The first pass over a directory, when none of its children can be
+ * cached yet, also brings them into the dcache, a bounded number per
+ * call, with their disk inodes prefetched a leaf at a time. So does a
+ * later pass if arrayfs_lookup saw the one before followed by lookups
+ * of what it returned. A pass whose children stayed cached needs no
+ * priming and doesn't get it.
+ */
 static int arrayfs_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
 	unsigned long ino = inode->i_ino;
-	long long pos = ctx->pos;
-	struct arrayfs_dir_data *data;
-	unsigned long index;
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	struct arrayfs_dir_data *leaf, *data;
+	struct arrayfs_dir_rec *rec, *recs[ARRAYFS_DIR_SLOTS];
+	struct arrayfs_leaf_lock *ll;
+	unsigned int dseq, lseq;
+	unsigned int i, j, n;
+	u32 hash, next;
 	unsigned int child_ino;
-	unsigned type;
-	
-	if (ino >= ARRAYFS_NR_INODES)
+	unsigned int budget = 0;
+	bool locked, stale;
+	int hits, err = 0;
+
+	if (ino >= sbi->nr_inodes)
 		return -EINVAL;
 
+	if (ctx->pos == 0) {
+		hits = atomic_xchg(&ai->i_prime_hits, 0);
+		if (!test_and_set_bit(ARRAYFS_I_LISTED, &ai->i_flags) ||
+				hits >= ARRAYFS_PRIME_HITS)
+			set_bit(ARRAYFS_I_PRIME_DCACHE, &ai->i_flags);
+		else
+			clear_bit(ARRAYFS_I_PRIME_DCACHE, &ai->i_flags);
+	}
+	WRITE_ONCE(ai->i_readdir_time, jiffies);
+	if (test_bit(ARRAYFS_I_PRIME_DCACHE, &ai->i_flags))
+		budget = ARRAYFS_PRIME_MAX;
+
 	pr_notice("%s, pos=%lld\n",
-				__func__, pos);
+				__func__, ctx->pos);
+
+	data = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	while (ctx->pos < ARRAYFS_HASH_EOF) {
+		hash = ctx->pos;
+retry:
+		dseq = arrayfs_dir_walk_begin(ai, &locked);
+		rcu_read_lock();
+		leaf = arrayfs_dx_leaf(inode, hash, &next);
+		if (!leaf) {
+			rcu_read_unlock();
+			if (arrayfs_dir_walk_end(ai, dseq, locked))
+				goto retry;
+			err = -EIO;
+			break;
+		}
+		ll = arrayfs_leaf_lock(inode, leaf);
+		lseq = read_seqcount_begin(&ll->seq);
+		memcpy(data, leaf, PAGE_SIZE);
+		rcu_read_unlock();
+		stale = arrayfs_dir_walk_end(ai, dseq, locked);
+		if (read_seqcount_retry(&ll->seq, lseq) || stale)
+			goto retry;
+
+		/* Insertion sort, a leaf is small */
+		n = 0;
+		for (i = 0; i < ARRAYFS_DIR_SLOTS; i++) {
+			/* Reserved slots aren't filled in yet */
+			if (!arrayfs_tag_used(data->tags[i]))
+				continue;
+			rec = arrayfs_dir_rec_checked(data, i, 0);
+			if (!rec || (void *)rec + ARRAYFS_REC_LEN(rec->name_len) >
+					(void *)data + PAGE_SIZE) {
+				err = -EIO;
+				goto out;
+			}
+			if (rec->hash < hash)
+				continue;
+			for (j = n++; j && recs[j - 1]->hash > rec->hash; j--)
+				recs[j] = recs[j - 1];
+			recs[j] = rec;
+		}
+
+		for (i = 0; i < min(n, budget); i++)
+			if (recs[i]->ino < sbi->nr_inodes)
+				prefetch(&sbi->disk_inodes[recs[i]->ino]);
+
+		for (i = 0; i < n; i++) {
+			rec = recs[i];
+			child_ino = rec->ino;
+			if (child_ino >= sbi->nr_inodes) {
+				err = -EIO;
+				goto out;
+			}
+			pr_notice("%s, diremit, name[%.*s]\n",
+				__func__, rec->name_len, rec->name);
+			if (!dir_emit(ctx, rec->name, rec->name_len,
+					child_ino, rec->file_type)) {
+				ctx->pos = rec->hash;
+				goto out;
+			}
+			if (budget) {
+				arrayfs_prime_dcache(file->f_path.dentry,
+						rec->name, rec->name_len,
+						child_ino);
+				budget--;
+			}
+		}
+		ctx->pos = next;
+	}
+	/* The pass is done, so is the priming it was turned on for */
+	if (ctx->pos >= ARRAYFS_HASH_EOF)
+		clear_bit(ARRAYFS_I_PRIME_DCACHE, &ai->i_flags);
+out:
+	kfree(data);
+	return err;
+}
+
+static loff_t arrayfs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+	return generic_file_llseek_size(file, offset, whence,
+				ARRAYFS_HASH_EOF, ARRAYFS_HASH_EOF);
+}
+
+static int arrayfs_dir_open(struct inode *inode, struct file *filp)
+{
+	pr_notice("%s\n", __func__);
+	return 0;
+}
+
+
+const struct file_operations arrayfs_dir_operations = {
+	.iterate_shared	= arrayfs_readdir,
+	.llseek		= arrayfs_dir_llseek,
+	.open		= arrayfs_dir_open,
+};
+
+loff_t arrayfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	pr_notice("%s\n",
+			__func__);
+	return generic_file_llseek(file, offset, whence);
+}
+
+int arrayfs_file_open(struct inode * inode, struct file * filp)
+{
+	pr_notice("%s\n",
+			__func__);
+	return generic_file_open(inode, filp);
+}
+
+int arrayfs_file_fsync(struct file *file, loff_t start, loff_t end,
+		       int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	int err;
+
+	pr_notice("%s\n",
+			__func__);
+
+	/*
+	 * A sync_fs that started after the inode was last dirtied has
+	 * flushed it already; pages dirtied since then, or still being
+	 * copied out, are tagged.
+	 */
+	if (READ_ONCE(ARRAYFS_I(inode)->i_dirty_epoch) <
+			atomic64_read(&sbi->synced_epoch) &&
+			!arrayfs_mapping_busy(inode->i_mapping))
+		return 0;
+
+	err = __generic_file_fsync(file, start, end, datasync);
+	if (err)
+		return err;
+	return 0;
+}
+
+/*
+ * Writes allocate their blocks before copying. One that stopped short
+ * of @end leaves blocks past EOF which nothing but unlink would free,
+ * so cut the file back to its size. Caller holds the inode lock.
+ */
+static void arrayfs_write_failed(struct inode *inode, loff_t end)
+{
+	loff_t size = i_size_read(inode);
+
+	if (end <= size)
+		return;
+	truncate_pagecache(inode, size);
+	arrayfs_truncate_blocks(inode, size);
+}
+
+/*
+ * Copy between @iter and the blocks of the file, starting at @pos, and
+ * return the number of bytes copied. Reads stop at i_size and see
+ * zeroes in holes, writes allocate the blocks they need. Both stop at
+ * max_file_pages. Used by DAX and O_DIRECT.
+ */
+static ssize_t arrayfs_copy_iter(struct inode *inode, loff_t pos,
+				struct iov_iter *iter)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	size_t count = iov_iter_count(iter);
+	bool write = iov_iter_rw(iter) == WRITE;
+	u32 run_start = 0, run_end = 0, run_pblk = 0;
+	ssize_t done = 0;
+	int err;
+
+	if (!write) {
+		loff_t size = i_size_read(inode);
+
+		if (pos >= size)
+			return 0;
+		count = min_t(loff_t, count, size - pos);
+	}
+
+	while (count) {
+		pgoff_t index = pos >> PAGE_SHIFT;
+		size_t offset = pos & (PAGE_SIZE - 1);
+		size_t bytes = min_t(size_t, PAGE_SIZE - offset, count);
+		char *addr;
+		size_t copied;
+		u32 len;
+
+		if (index >= sbi->max_file_pages)
+			break;
+
+		if (index >= run_end) {
+			u32 max = min_t(u64, DIV_ROUND_UP(offset + count, PAGE_SIZE),
+					sbi->max_file_pages - index);
+
+			err = arrayfs_get_blocks(inode, index, max, write,
+						&run_pblk, &len);
+			if (err) {
+				if (!done)
+					done = err;
+				break;
+			}
+			run_start = index;
+			run_end = index + len;
+		}
+
+		if (!run_pblk) {
+			/* A hole, only reads get here */
+			copied = iov_iter_zero(bytes, iter);
+		} else {
+			addr = arrayfs_blk_addr(sbi, run_pblk + index - run_start)
+					+ offset;
+			if (write)
+				copied = copy_from_iter(addr, bytes, iter);
+			else
+				copied = copy_to_iter(addr, bytes, iter);
+		}
+
+		done += copied;
+		pos += copied;
+		count -= copied;
+		if (copied < bytes) {
+			if (!done)
+				done = -EFAULT;
+			break;
+		}
+		cond_resched();
+	}
+	return done;
+}
+
+/*
+ * Reads that bypass the page cache, for DAX and O_DIRECT. The shared
+ * inode lock keeps truncate from freeing the blocks under the copy.
+ */
+static ssize_t arrayfs_direct_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t pos = iocb->ki_pos;
+	size_t count = iov_iter_count(to);
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+
+	/* Buffered writes still sitting in the page cache go first */
+	if (!test_opt(ARRAYFS_I_SB(inode), DAX)) {
+		ret = filemap_write_and_wait_range(inode->i_mapping, pos,
+					pos + count - 1);
+		if (ret) {
+			inode_unlock_shared(inode);
+			return ret;
+		}
+	}
+	ret = arrayfs_copy_iter(inode, pos, to);
+	inode_unlock_shared(inode);
+	if (ret > 0)
+		iocb->ki_pos += ret;
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+/*
+ * Writes that bypass the page cache, for DAX and O_DIRECT. Overwrites
+ * that stay inside i_size only take the inode lock shared, so they can
+ * run in parallel; anything that extends the file, or has to strip
+ * suid bits, takes it exclusive.
+ */
+static ssize_t arrayfs_direct_write_iter(struct kiocb *iocb,
+				struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct address_space *mapping = file->f_mapping;
+	bool dax = test_opt(ARRAYFS_I_SB(inode), DAX);
+	bool shared;
+	loff_t pos, end;
+	ssize_t ret;
+
+	shared = !(iocb->ki_flags & IOCB_APPEND) &&
+		iocb->ki_pos + iov_iter_count(from) <= i_size_read(inode);
+relock:
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (shared ? !inode_trylock_shared(inode) : !inode_trylock(inode))
+			return -EAGAIN;
+	} else if (shared) {
+		inode_lock_shared(inode);
+	} else {
+		inode_lock(inode);
+	}
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+
+	if (shared && (!IS_NOSEC(inode) ||
+		iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))) {
+		inode_unlock_shared(inode);
+		shared = false;
+		goto relock;
+	}
+
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	pos = iocb->ki_pos;
+	end = pos + iov_iter_count(from) - 1;
+	if (!dax) {
+		ret = filemap_write_and_wait_range(mapping, pos, end);
+		if (ret)
+			goto out_unlock;
+	}
+
+	ret = arrayfs_copy_iter(inode, pos, from);
+	if (ret > 0) {
+		if (!dax)
+			invalidate_inode_pages2_range(mapping,
+					pos >> PAGE_SHIFT, end >> PAGE_SHIFT);
+		iocb->ki_pos += ret;
+		if (iocb->ki_pos > i_size_read(inode)) {
+			i_size_write(inode, iocb->ki_pos);
+			mark_inode_dirty(inode);
+		}
+	}
+	arrayfs_write_failed(inode, end + 1);
+out_unlock:
+	if (shared)
+		inode_unlock_shared(inode);
+	else
+		inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static ssize_t arrayfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(file_inode(iocb->ki_filp));
+
+	/* The page cache is the storage, there is nothing to bypass */
+	if (test_opt(sbi, PAGECACHE))
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	if (test_opt(sbi, DAX) || (iocb->ki_flags & IOCB_DIRECT))
+		return arrayfs_direct_read_iter(iocb, to);
+	return generic_file_read_iter(iocb, to);
+}
+
+/*
+ * Allocate the blocks behind a buffered write up front, in as few runs
+ * as the allocator manages, so writeback only has to copy. If the pool
+ * runs out part way, the write is cut short to what got allocated.
+ */
+static ssize_t arrayfs_prealloc(struct inode *inode, loff_t pos,
+				struct iov_iter *from)
+{
+	u32 lblk = pos >> PAGE_SHIFT;
+	u32 end = (pos + iov_iter_count(from) - 1) >> PAGE_SHIFT;
+	u32 pblk, len;
+	int err;
+
+	while (lblk <= end) {
+		err = arrayfs_get_blocks(inode, lblk, end - lblk + 1, true,
+					&pblk, &len);
+		if (err) {
+			if ((loff_t)lblk << PAGE_SHIFT <= pos)
+				return err;
+			iov_iter_truncate(from, ((loff_t)lblk << PAGE_SHIFT) - pos);
+			break;
+		}
+		lblk += len;
+	}
+	return iov_iter_count(from);
+}
+
+static ssize_t arrayfs_buffered_write_iter(struct kiocb *iocb,
+				struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret > 0)
+		ret = arrayfs_prealloc(inode, iocb->ki_pos, from);
+	if (ret > 0) {
+		loff_t end = iocb->ki_pos + ret;
+
+		ret = __generic_file_write_iter(iocb, from);
+		arrayfs_write_failed(inode, end);
+	}
+	inode_unlock(inode);
+
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static ssize_t arrayfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(file_inode(iocb->ki_filp));
+
+	/* The page cache is the storage, no blocks to allocate */
+	if (test_opt(sbi, PAGECACHE)) {
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		return generic_file_write_iter(iocb, from);
+	}
+	if (test_opt(sbi, DAX) || (iocb->ki_flags & IOCB_DIRECT))
+		return arrayfs_direct_write_iter(iocb, from);
+	return arrayfs_buffered_write_iter(iocb, from);
+}
+
+/*
+ * DAX faults map the array pages themselves. Shared mappings are
+ * VM_PFNMAP so that a PMD can be installed when a whole chunk backs
+ * the faulting range; private mappings hand the array page to the
+ * core fault code, which does the copy-on-write for us.
+ */
+static vm_fault_t arrayfs_dax_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct inode *inode = file_inode(vma->vm_file);
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	pgoff_t end;
+	vm_fault_t ret = 0;
+	u32 blk, len;
+	int err;
+
+	/* Keeps truncate from freeing the block before it is mapped */
+	down_read(&ai->i_mmap_sem);
+	end = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+	if (vmf->pgoff >= end || vmf->pgoff >= sbi->max_file_pages) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	/* There is no zero page to map holes to, fill them instead */
+	err = arrayfs_get_blocks(inode, vmf->pgoff, 1, true, &blk, &len);
+	if (err) {
+		ret = vmf_error(err);
+		goto out;
+	}
 
-	data = (struct arrayfs_dir_data *)global_data[ino][0];
-	for (;;) {
-		index = find_next_bit(&data->bitmap, 64, pos);
-		if (index == 64) {
-			ctx->pos = pos = 64;
-			break;
-		} else {
-			child_ino = data->entries[index].ino;
-			if (child_ino >= ARRAYFS_NR_INODES)
-				return 1;
-			if (S_ISREG(global_inodes[child_ino].mode))
-				type = DT_REG;
-			else
-				type = DT_DIR;
-			pr_notice("%s, diremit, name[%s]\n",
-				__func__, data->entries[index].name);
-			if (!dir_emit(ctx, data->entries[index].name, strlen(data->entries[index].name),
-					child_ino, type))
-				return 1;
-			ctx->pos = pos = index + 1;
-		}
+	if (vma->vm_flags & VM_PFNMAP) {
+		ret = vmf_insert_pfn(vma, vmf->address,
+				page_to_pfn(arrayfs_blk_page(sbi, blk)));
+		goto out;
 	}
-	return 0;
-}
 
-static int arrayfs_dir_open(struct inode *inode, struct file *filp)
-{
-	pr_notice("%s\n", __func__);
-	return 0;
+	vmf->page = arrayfs_blk_page(sbi, blk);
+	get_page(vmf->page);
+out:
+	up_read(&ai->i_mmap_sem);
+	return ret;
 }
 
+/*
+ * Only a real DAX inode may get a PMD. Without FS_DAX, S_DAX is 0 and
+ * the core would take the huge PMD over the split chunk pages for a
+ * THP, and drop references on them at munmap or split.
+ */
+#ifdef CONFIG_FS_DAX_PMD
+static vm_fault_t arrayfs_dax_pmd_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct inode *inode = file_inode(vma->vm_file);
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	unsigned long pmd_addr = vmf->address & PMD_MASK;
+	vm_fault_t ret = VM_FAULT_FALLBACK;
+	pgoff_t end, pgoff;
+	u32 blk, len;
+	struct arrayfs_chunk *c;
+
+	if (!IS_DAX(inode) || !(vma->vm_flags & VM_PFNMAP))
+		return VM_FAULT_FALLBACK;
+	if (pmd_addr < vma->vm_start || pmd_addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	pgoff = vmf->pgoff - ((vmf->address - pmd_addr) >> PAGE_SHIFT);
+	if (pgoff & (ARRAYFS_CHUNK_PAGES - 1))
+		return VM_FAULT_FALLBACK;
+
+	down_read(&ai->i_mmap_sem);
+	end = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+	if (pgoff + ARRAYFS_CHUNK_PAGES > min_t(pgoff_t, end,
+						sbi->max_file_pages))
+		goto out;
 
-const struct file_operations arrayfs_dir_operations = {
-	.iterate_shared	= arrayfs_readdir,
-	.open		= arrayfs_dir_open,
-};
+	/*
+	 * The backing blocks must be one aligned, contiguous chunk. Holes
+	 * are left to the PTE path, which allocates them page by page.
+	 */
+	if (arrayfs_get_blocks(inode, pgoff, ARRAYFS_CHUNK_PAGES, false,
+				&blk, &len))
+		goto out;
+	if (!blk || len < ARRAYFS_CHUNK_PAGES ||
+			(blk & (ARRAYFS_CHUNK_PAGES - 1)))
+		goto out;
+	c = &sbi->chunks[blk >> ARRAYFS_CHUNK_SHIFT];
+	if (!c->page)
+		goto out;
 
-loff_t arrayfs_file_llseek(struct file *file, loff_t offset, int whence)
+	ret = vmf_insert_pfn_pmd(vma, pmd_addr, vmf->pmd,
+			pfn_to_pfn_t(page_to_pfn(c->page)),
+			vmf->flags & FAULT_FLAG_WRITE);
+out:
+	up_read(&ai->i_mmap_sem);
+	return ret;
+}
+#else
+static vm_fault_t arrayfs_dax_pmd_fault(struct vm_fault *vmf)
 {
-	pr_notice("%s\n",
-			__func__);
-	return generic_file_llseek(file, offset, whence);
+	return VM_FAULT_FALLBACK;
 }
+#endif
 
-int arrayfs_file_open(struct inode * inode, struct file * filp)
+static vm_fault_t arrayfs_dax_huge_fault(struct vm_fault *vmf,
+				enum page_entry_size pe_size)
 {
-	pr_notice("%s\n",
-			__func__);
-	return generic_file_open(inode, filp);
+	if (pe_size == PE_SIZE_PTE)
+		return arrayfs_dax_fault(vmf);
+	if (pe_size == PE_SIZE_PMD)
+		return arrayfs_dax_pmd_fault(vmf);
+	return VM_FAULT_FALLBACK;
 }
 
-int arrayfs_file_fsync(struct file *file, loff_t start, loff_t end,
-		       int datasync)
+static const struct vm_operations_struct arrayfs_dax_vm_ops = {
+	.fault		= arrayfs_dax_fault,
+	.huge_fault	= arrayfs_dax_huge_fault,
+};
+
+/*
+ * Allocate the block behind a page before it can be dirtied through
+ * mmap. Like filemap_page_mkwrite, but the page is checked against
+ * truncate before the block is allocated, not after.
+ */
+static vm_fault_t arrayfs_page_mkwrite(struct vm_fault *vmf)
 {
-	struct inode *inode = file->f_mapping->host;
+	struct page *page = vmf->page;
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+	vm_fault_t ret = VM_FAULT_LOCKED;
+	u32 blk, len;
 	int err;
 
-	pr_notice("%s\n",
-			__func__);
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	down_read(&ai->i_mmap_sem);
+	lock_page(page);
+	if (page->mapping != inode->i_mapping ||
+			page_offset(page) >= i_size_read(inode)) {
+		unlock_page(page);
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+	err = arrayfs_get_blocks(inode, page->index, 1, true, &blk, &len);
+	if (err) {
+		unlock_page(page);
+		ret = vmf_error(err);
+		goto out;
+	}
+	set_page_dirty(page);
+	wait_for_stable_page(page);
+out:
+	up_read(&ai->i_mmap_sem);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
 
-	err = __generic_file_fsync(file, start, end, datasync);
-	if (err)
-		return err;
+static const struct vm_operations_struct arrayfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= arrayfs_page_mkwrite,
+};
+
+static int arrayfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(file_inode(file));
+
+	if (test_opt(sbi, PAGECACHE))
+		return generic_file_mmap(file, vma);
+	if (!test_opt(sbi, DAX)) {
+		file_accessed(file);
+		vma->vm_ops = &arrayfs_file_vm_ops;
+		return 0;
+	}
+
+	file_accessed(file);
+	vma->vm_ops = &arrayfs_dax_vm_ops;
+	if (vma->vm_flags & VM_SHARED)
+		vma->vm_flags |= VM_PFNMAP;
 	return 0;
 }
 
-
 const struct file_operations arrayfs_file_operations = {
 	.llseek		= arrayfs_file_llseek,
-	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
+	.read_iter	= arrayfs_file_read_iter,
+	.write_iter	= arrayfs_file_write_iter,
+	.mmap		= arrayfs_file_mmap,
+	.get_unmapped_area = thp_get_unmapped_area,
 	.open		= arrayfs_file_open,
 	.fsync		= arrayfs_file_fsync,
 };
@@ -374,25 +2832,33 @@ const struct file_operations arrayfs_file_operations = {
 static int arrayfs_read_datapage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
 	unsigned long ino = inode->i_ino;
 	unsigned long index = page->index;
+	u32 blk, len;
 
-	if (index >= ARRAYFS_NR_PGS_PER_FILE) {
+	if (index >= sbi->max_file_pages) {
 		pr_warning("%s, index=%lu\n",
 					__func__, index);
-		return 0;
+		goto out;
 	}
 	
-	if (ino >= ARRAYFS_NR_INODES) {
+	if (ino >= sbi->nr_inodes) {
 		pr_warning("%s, ino=%lu\n",
 					__func__, ino);
-		return 0;
+		goto out;
 	}
 
-	memcpy(page_to_virt(page), global_data[ino][index], PAGE_SIZE);
+	/* Holes read as zeroes */
+	if (arrayfs_get_blocks(inode, index, 1, false, &blk, &len) || !blk)
+		clear_highpage(page);
+	else
+		memcpy(page_to_virt(page), arrayfs_blk_addr(sbi, blk), PAGE_SIZE);
 	SetPageUptodate(page);
 	pr_notice("%s, ino=%lu, index=%lu, pageflags=0x%lx\n",
 				__func__, ino, index, page->flags);
+out:
+	unlock_page(page);
 	return 0;
 }
 
@@ -418,44 +2884,80 @@ static int arrayfs_read_data_pages(struct file *file,
 	return 0;
 }
 
-static int arrayfs_write_datapage(struct page *page,
+/*
+ * Copy one locked page to its block. The dirty bit is cleared before
+ * the copy, so a store through mmap that races with us redirties the
+ * page instead of being lost. The copy runs under PG_writeback, which
+ * moves the page from the dirty tag to the writeback tag, so fsync
+ * and sync_fs can tell what is still in flight. Blocks are normally
+ * allocated at write or page_mkwrite time; allocating here only covers
+ * pages dirtied some other way. If that fails the page is redirtied,
+ * its contents are still only in the page cache.
+ */
+static int __arrayfs_write_datapage(struct page *page,
 					struct writeback_control *wbc)
 {
 	struct inode *inode = page->mapping->host;
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
 	unsigned long index = page->index;
 	unsigned long ino = inode->i_ino;
+	u32 blk, len;
+	int err;
 
-	if (index >= ARRAYFS_NR_PGS_PER_FILE) {
+	if (index >= sbi->max_file_pages) {
 		pr_warning("%s, index=%lu\n",
 					__func__, index);
 		return 0;
 	}
 	
-	if (ino >= ARRAYFS_NR_INODES) {
+	if (ino >= sbi->nr_inodes) {
 		pr_warning("%s, ino=%lu\n",
 					__func__, ino);
 		return 0;
 	}
-	
-	memcpy(global_data[ino][index], page_to_virt(page), PAGE_SIZE);
-	clear_page_dirty_for_io(page);
+
+	if (!clear_page_dirty_for_io(page))
+		return 0;
+
+	err = arrayfs_get_blocks(inode, index, 1, true, &blk, &len);
+	if (err) {
+		pr_err("%s, ino=%lu, index=%lu, err=%d\n",
+				__func__, ino, index, err);
+		redirty_page_for_writepage(wbc, page);
+		mapping_set_error(page->mapping, err);
+		return err;
+	}
+	set_page_writeback(page);
+	memcpy(arrayfs_blk_addr(sbi, blk), page_to_virt(page), PAGE_SIZE);
+	end_page_writeback(page);
 	pr_notice("%s, ino=%lu, index=%lu, pageflags=0x%lx\n",
 				__func__, ino, index, page->flags);
 	return 0;
 }
 
+static int arrayfs_write_datapage(struct page *page,
+					struct writeback_control *wbc)
+{
+	int err = __arrayfs_write_datapage(page, wbc);
+
+	unlock_page(page);
+	return err;
+}
+
 
 static int arrayfs_write_data_pages(struct address_space *mapping,
 			    struct writeback_control *wbc)
 {
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(mapping->host);
 	pgoff_t startpage = wbc->range_start >> PAGE_SHIFT;
 	pgoff_t endpage = wbc->range_end >> PAGE_SHIFT;
 	int tag = PAGECACHE_TAG_TOWRITE;
 	unsigned nrpages;
 	struct pagevec pvec;
+	int err, ret = 0;
 
-	if (endpage >= ARRAYFS_NR_PGS_PER_FILE)
-		endpage = ARRAYFS_NR_PGS_PER_FILE;
+	if (endpage >= sbi->max_file_pages)
+		endpage = sbi->max_file_pages;
 
 	pr_notice("%s, startpage=%lu, endpage=%lu\n",
 			__func__, startpage, endpage);
@@ -475,98 +2977,457 @@ static int arrayfs_write_data_pages(struct address_space *mapping,
 			struct page *page = pvec.pages[i];
 
 			lock_page(page);
-			arrayfs_write_datapage(page, wbc);
+			/* Truncated while we weren't looking */
+			if (page->mapping == mapping) {
+				err = __arrayfs_write_datapage(page, wbc);
+				if (err && !ret)
+					ret = err;
+				wbc->nr_to_write--;
+			}
 			unlock_page(page);
 		}
 		pagevec_release(&pvec);
+		/* Background writeback only asked for so much */
+		if (wbc->nr_to_write <= 0 && wbc->sync_mode == WB_SYNC_NONE)
+			break;
 	}
-	return 0;
+	return ret;
 }
 
 
+/* simple_write_end grows i_size without dirtying the inode */
+static int arrayfs_write_end(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned copied,
+			struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t old_size = inode->i_size;
+	int ret;
+
+	ret = simple_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (inode->i_size > old_size)
+		mark_inode_dirty(inode);
+	return ret;
+}
+
 const struct address_space_operations arrayfs_file_aops = {
 	.readpage	= arrayfs_read_datapage,
 	.readpages	= arrayfs_read_data_pages,
 	.writepage	= arrayfs_write_datapage,
 	.writepages	= arrayfs_write_data_pages,
 	.write_begin = simple_write_begin,
-	.write_end = simple_write_end,
+	.write_end = arrayfs_write_end,
+	/* O_DIRECT is done in read_iter/write_iter, open just checks this */
+	.direct_IO	= noop_direct_IO,
+};
+
+/*
+ * Used with the pagecache mount option. The page cache pages are the
+ * only copy of the file data, so there is nothing to read them from
+ * and nothing to write them back to.
+ */
+const struct address_space_operations arrayfs_pagecache_aops = {
+	.readpage	= simple_readpage,
+	.write_begin	= simple_write_begin,
+	.write_end	= simple_write_end,
+	.set_page_dirty	= __set_page_dirty_no_writeback,
+	.direct_IO	= noop_direct_IO,
 };
 
 static struct inode *arrayfs_alloc_inode(struct super_block *sb)
 {
-	struct arrayfs_sb *sbi = sb->s_fs_info;
-	int pa;
 	struct arrayfs_inode *si;
 
-	spin_lock(&sbi->inode_bmlock);
-	pa = find_first_zero_bit(&sbi->inode_bm, ARRAYFS_NR_INODES);
-	if (pa == ARRAYFS_NR_INODES) {
-		spin_unlock(&sbi->inode_bmlock);
+	si = kmem_cache_alloc(arrayfs_inode_cachep, GFP_NOFS);
+	if (!si)
 		return NULL;
+
+	RCU_INIT_POINTER(si->i_bloom, NULL);
+	si->i_flags = 0;
+	si->i_readdir_time = jiffies - ARRAYFS_PRIME_WINDOW;
+	atomic_set(&si->i_prime_hits, 0);
+	si->i_dirty_epoch = 0;
+	return &si->vfs_inode;
+}
+
+/*
+ * Dirtying an inode only queues it; the disk record is brought up to
+ * date by write_inode, sync_fs or eviction, whichever comes first.
+ */
+static void arrayfs_dirty_inode(struct inode *inode, int flags)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+
+	spin_lock(&sbi->dirty_lock);
+	if (list_empty(&ai->i_dirty))
+		list_add_tail(&ai->i_dirty, &sbi->dirty_inodes);
+	spin_unlock(&sbi->dirty_lock);
+	/*
+	 * Sampled after queueing: a sync_fs pass that opens a later epoch
+	 * is guaranteed to find this inode on the list.
+	 */
+	smp_mb();
+	WRITE_ONCE(ai->i_dirty_epoch, atomic64_read(&sbi->sync_epoch));
+}
+
+/* Caller holds dirty_lock, which keeps eviction from freeing @ai */
+static void __arrayfs_flush_inode(struct arrayfs_inode *ai)
+{
+	list_del_init(&ai->i_dirty);
+	arrayfs_fill_disk_inode(arrayfs_di(&ai->vfs_inode), &ai->vfs_inode);
+}
+
+static void arrayfs_flush_inode(struct inode *inode)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_inode *ai = ARRAYFS_I(inode);
+
+	spin_lock(&sbi->dirty_lock);
+	if (!list_empty(&ai->i_dirty))
+		__arrayfs_flush_inode(ai);
+	spin_unlock(&sbi->dirty_lock);
+}
+
+/*
+ * Write back every queued inode record in one pass. The queue is taken
+ * private so that dirty_lock is only held a batch at a time; eviction
+ * still finds its inode under the lock, whichever list it is on. The
+ * caller holds sync_mutex so that no sync_fs can finish while another
+ * flusher still holds inodes off the queue.
+ */
+static void arrayfs_flush_dirty_inodes(struct arrayfs_sb *sbi)
+{
+	LIST_HEAD(dirty);
+	int n;
+
+	lockdep_assert_held(&sbi->sync_mutex);
+
+	spin_lock(&sbi->dirty_lock);
+	list_splice_init(&sbi->dirty_inodes, &dirty);
+	while (!list_empty(&dirty)) {
+		for (n = 0; n < ARRAYFS_FLUSH_BATCH && !list_empty(&dirty); n++)
+			__arrayfs_flush_inode(list_first_entry(&dirty,
+					struct arrayfs_inode, i_dirty));
+		spin_unlock(&sbi->dirty_lock);
+		cond_resched();
+		spin_lock(&sbi->dirty_lock);
 	}
-	set_bit(pa, &sbi->inode_bm);
-	spin_unlock(&sbi->inode_bmlock);
+	spin_unlock(&sbi->dirty_lock);
+}
 
-	si = &memory_inodes[pa];
+static int arrayfs_write_inode(struct inode *inode,
+				struct writeback_control *wbc)
+{
+	arrayfs_flush_inode(inode);
+	return 0;
+}
 
-	inode_init_once(&si->vfs_inode);
-	pr_notice("%s, allocate new in-memory inode, pa=%d\n",
-				__func__, pa);
+/*
+ * Flush the whole filesystem in one pass over the ino table, so pages
+ * go out by inode and then by offset. Only the waiting pass does the
+ * work; the first, non-waiting one from sync(2) would just repeat it.
+ */
+static int arrayfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_SB(sb);
+	struct inode *inode;
+	unsigned long ino;
+	s64 epoch;
+	int err, ret = 0;
 
-	return &si->vfs_inode;
+	if (!wait) {
+		mutex_lock(&sbi->sync_mutex);
+		arrayfs_flush_dirty_inodes(sbi);
+		mutex_unlock(&sbi->sync_mutex);
+		return 0;
+	}
+
+	mutex_lock(&sbi->sync_mutex);
+	epoch = atomic64_inc_return(&sbi->sync_epoch);
+	for (ino = 0; ino < sbi->nr_inodes; ino++) {
+		rcu_read_lock();
+		inode = rcu_dereference(sbi->inode_table[ino]);
+		if (inode && arrayfs_mapping_busy(inode->i_mapping))
+			inode = igrab(inode);
+		else
+			inode = NULL;
+		rcu_read_unlock();
+		if (!inode)
+			continue;
+
+		err = filemap_write_and_wait(inode->i_mapping);
+		if (err && !ret)
+			ret = err;
+		iput(inode);
+		cond_resched();
+	}
+	arrayfs_flush_dirty_inodes(sbi);
+	if (!ret)
+		atomic64_set(&sbi->synced_epoch, epoch);
+	mutex_unlock(&sbi->sync_mutex);
+	return ret;
+}
+
+static void arrayfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(arrayfs_inode_cachep, ARRAYFS_I(inode));
 }
 
 static void arrayfs_destroy_inode(struct inode *inode)
 {
 	struct arrayfs_inode *si = ARRAYFS_I(inode);
-	int pa = si - memory_inodes;
-	//struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	struct arrayfs_bloom *bloom = rcu_dereference_protected(si->i_bloom, true);
+
+	/* Lockless lookups and arrayfs_iget may still be looking at it */
+	if (bloom)
+		call_rcu(&bloom->rcu, arrayfs_bloom_free_rcu);
+	call_rcu(&inode->i_rcu, arrayfs_i_callback);
+}
+
+/* Give back everything an unlinked inode held */
+static void arrayfs_reclaim_inode(struct arrayfs_sb *sbi, unsigned long ino)
+{
+	struct arrayfs_disk_inode *di = &sbi->disk_inodes[ino];
+
+	arrayfs_free_extents(sbi, di, 0);
+	memset(di, 0, sizeof(*di));
+	arrayfs_free_ino(sbi, ino);
+}
+
+/*
+ * One pass over the orphan bitmap, in ino order, takes whatever piled
+ * up since the last one. Orphans queued meanwhile requeue the work.
+ */
+static void arrayfs_reclaim_work(struct work_struct *work)
+{
+	struct arrayfs_sb *sbi = container_of(work, struct arrayfs_sb,
+					reclaim_work);
+	unsigned long ino;
+
+	for_each_set_bit(ino, sbi->orphans, sbi->nr_inodes) {
+		if (!test_and_clear_bit(ino, sbi->orphans))
+			continue;
+		arrayfs_reclaim_inode(sbi, ino);
+		cond_resched();
+	}
+}
+
+static void arrayfs_evict_inode(struct inode *inode)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+	unsigned long ino = inode->i_ino;
+
+	truncate_inode_pages_final(&inode->i_data);
+	arrayfs_flush_inode(inode);
+	/*
+	 * A new inode for this ino can't be published before eviction
+	 * finishes, iget_locked and insert_inode_locked wait for us.
+	 */
+	if (ino < sbi->nr_inodes &&
+			rcu_access_pointer(sbi->inode_table[ino]) == inode)
+		RCU_INIT_POINTER(sbi->inode_table[ino], NULL);
+	/*
+	 * iget_locked and insert_inode_locked wait for eviction to finish,
+	 * so the number can't be reused while the worker frees it.
+	 */
+	if (!inode->i_nlink && !is_bad_inode(inode) && ino < sbi->nr_inodes) {
+		set_bit(ino, sbi->orphans);
+		queue_work(sbi->reclaim_wq, &sbi->reclaim_work);
+	}
+	clear_inode(inode);
+}
+
+static void arrayfs_free_chunks(struct arrayfs_sb *sbi)
+{
+	unsigned long i, j;
+
+	if (!sbi->chunks)
+		return;
+
+	for (i = 0; i < sbi->nr_chunks; i++) {
+		struct arrayfs_chunk *c = &sbi->chunks[i];
+
+		if (c->page) {
+			for (j = 0; j < ARRAYFS_CHUNK_PAGES; j++)
+				__free_page(c->page + j);
+		} else {
+			vfree(c->addr);
+		}
+	}
+	kvfree(sbi->chunks);
+	sbi->chunks = NULL;
+}
 
-	pr_notice("%s, %d\n", __func__, pa);
+/*
+ * Try to get every full chunk as one physically contiguous, PMD
+ * aligned allocation so DAX can map it huge. If memory is too
+ * fragmented for that, fall back to vmalloc for that chunk.
+ */
+static int arrayfs_alloc_chunks(struct arrayfs_sb *sbi)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY;
+	unsigned long i, nr;
+
+	sbi->nr_chunks = DIV_ROUND_UP(sbi->nr_blocks, ARRAYFS_CHUNK_PAGES);
+	sbi->chunks = kvcalloc(sbi->nr_chunks, sizeof(struct arrayfs_chunk),
+					GFP_KERNEL);
+	if (!sbi->chunks)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->nr_chunks; i++) {
+		struct arrayfs_chunk *c = &sbi->chunks[i];
+
+		nr = min(sbi->nr_blocks - (i << ARRAYFS_CHUNK_SHIFT),
+					ARRAYFS_CHUNK_PAGES);
+		if (nr == ARRAYFS_CHUNK_PAGES && ARRAYFS_CHUNK_SHIFT < MAX_ORDER) {
+			c->page = alloc_pages(gfp, ARRAYFS_CHUNK_SHIFT);
+			if (c->page) {
+				/* Every page gets its own refcount for mmap */
+				split_page(c->page, ARRAYFS_CHUNK_SHIFT);
+				c->addr = page_address(c->page);
+				continue;
+			}
+		}
+		c->addr = vzalloc(nr << PAGE_SHIFT);
+		if (!c->addr)
+			return -ENOMEM;
+		cond_resched();
+	}
+	return 0;
+}
 
-	//spin_lock(&sbi->inode_bmlock);
-	//clear_bit(pa, &sbi->inode_bm);
-	//spin_unlock(&sbi->inode_bmlock);
+static void arrayfs_free_storage(struct arrayfs_sb *sbi)
+{
+	/* Lets pending reclaim finish with the storage first */
+	if (sbi->reclaim_wq)
+		destroy_workqueue(sbi->reclaim_wq);
+	sbi->reclaim_wq = NULL;
+	kvfree(sbi->orphans);
+	sbi->orphans = NULL;
+	kvfree(sbi->inode_table);
+	arrayfs_bitmap_destroy(&sbi->inode_map);
+	arrayfs_bitmap_destroy(&sbi->block_map);
+	free_percpu(sbi->mags);
+	sbi->mags = NULL;
+	percpu_counter_destroy(&sbi->free_blocks);
+	percpu_counter_destroy(&sbi->free_inodes);
+	vfree(sbi->disk_inodes);
+	arrayfs_free_chunks(sbi);
+	sbi->inode_table = NULL;
+	sbi->disk_inodes = NULL;
 }
 
 static void arrayfs_put_super(struct super_block *sb)
 {
-	spin_lock(&global_sb.m_lock);
-	global_sb.mounted = 0;
-	spin_unlock(&global_sb.m_lock);
+	arrayfs_free_storage(ARRAYFS_SB(sb));
+}
+
+/* Approximate by design: reading the counters never takes their lock */
+static int arrayfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_SB(dentry->d_sb);
+
+	buf->f_type = ARRAYFS_SUPER_MAGIC;
+	buf->f_bsize = PAGE_SIZE;
+	/*
+	 * In pagecache mode the pool only holds directories and the data
+	 * is unbounded page cache, so like ramfs report no block counts.
+	 */
+	if (!test_opt(sbi, PAGECACHE)) {
+		buf->f_blocks = sbi->nr_blocks;
+		buf->f_bfree = percpu_counter_read_positive(&sbi->free_blocks);
+		buf->f_bavail = buf->f_bfree;
+	}
+	buf->f_files = sbi->nr_inodes;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+	buf->f_namelen = ARRAYFS_NAME_LEN;
+	return 0;
+}
+
+static int arrayfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct arrayfs_sb *sbi = root->d_sb->s_fs_info;
+
+	seq_printf(seq, ",size=%llu,nr_inodes=%lu,max_file_pages=%lu",
+			(unsigned long long)sbi->nr_blocks << PAGE_SHIFT,
+			sbi->nr_inodes, sbi->max_file_pages);
+	if (test_opt(sbi, PAGECACHE))
+		seq_puts(seq, ",pagecache");
+	if (test_opt(sbi, DAX))
+		seq_puts(seq, ",dax");
+	return 0;
 }
 
 static const struct super_operations arrayfs_sops = {
 	.alloc_inode	= arrayfs_alloc_inode,
 	//.drop_inode	= f2fs_drop_inode,
 	.destroy_inode	= arrayfs_destroy_inode,
-	//.write_inode	= f2fs_write_inode,
-	//.dirty_inode	= f2fs_dirty_inode,
-	//.show_options	= f2fs_show_options,
-	//.evict_inode	= f2fs_evict_inode,
+	.write_inode	= arrayfs_write_inode,
+	.dirty_inode	= arrayfs_dirty_inode,
+	.sync_fs	= arrayfs_sync_fs,
+	.statfs		= arrayfs_statfs,
+	.show_options	= arrayfs_show_options,
+	.evict_inode	= arrayfs_evict_inode,
 	.put_super	= arrayfs_put_super,
 };
 
 static int arrayfs_read_inode(struct inode *inode)
 {
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
 	unsigned long ino = inode->i_ino;
-	struct arrayfs_disk_inode *di;
+	struct arrayfs_disk_inode di;
 
-	if (ino >= ARRAYFS_NR_INODES)
+	if (ino >= sbi->nr_inodes)
 		return -EINVAL;
 
-	di = &global_inodes[ino];
-	inode->i_mode = di->mode;
-	inode->i_size = di->size;
+	/* The whole record is one aligned line, take it in one go */
+	di = sbi->disk_inodes[ino];
+	/* A free or reclaimed number, e.g. from a stale handle */
+	if (!di.nlink)
+		return -ESTALE;
+	inode->i_mode = di.mode;
+	set_nlink(inode, di.nlink);
+	i_uid_write(inode, di.uid);
+	i_gid_write(inode, di.gid);
+	inode->i_size = di.size;
+	inode->i_atime = ns_to_timespec64(di.atime);
+	inode->i_mtime = ns_to_timespec64(di.mtime);
+	inode->i_ctime = ns_to_timespec64(di.ctime);
 	return 0;
 }
 
+/* Make a fully set up inode visible to the arrayfs_iget fast path */
+static void arrayfs_publish_inode(struct inode *inode)
+{
+	struct arrayfs_sb *sbi = ARRAYFS_I_SB(inode);
+
+	rcu_assign_pointer(sbi->inode_table[inode->i_ino], inode);
+}
+
 static struct inode *arrayfs_iget(struct super_block *sb, unsigned long ino)
 {
+	struct arrayfs_sb *sbi = ARRAYFS_SB(sb);
 	struct inode *inode;
 	int ret;
 
+	/*
+	 * Inode numbers are dense, so a live inode is a table load away.
+	 * igrab refuses inodes on their way out; those, and anything not
+	 * yet published, go the iget_locked way.
+	 */
+	if (ino < sbi->nr_inodes) {
+		rcu_read_lock();
+		inode = rcu_dereference(sbi->inode_table[ino]);
+		if (inode)
+			inode = igrab(inode);
+		rcu_read_unlock();
+		if (inode)
+			return inode;
+	}
+
 	inode = iget_locked(sb, ino);
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
@@ -580,14 +3441,13 @@ static struct inode *arrayfs_iget(struct super_block *sb, unsigned long ino)
 		goto bad_inode;
 
 	if (S_ISREG(inode->i_mode)) {
-		inode->i_op = &arrayfs_file_iops;
-		inode->i_fop = &arrayfs_file_operations;
-		inode->i_mapping->a_ops = &arrayfs_file_aops;
+		arrayfs_set_file_ops(inode);
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &arrayfs_dir_iops;
 		inode->i_fop = &arrayfs_dir_operations;
 	}
 	unlock_new_inode(inode);
+	arrayfs_publish_inode(inode);
 	return inode;
 
 bad_inode:
@@ -595,27 +3455,233 @@ bad_inode:
 	return ERR_PTR(ret);
 }
 
+enum {
+	Opt_size, Opt_nr_inodes, Opt_max_file_pages, Opt_pagecache, Opt_dax,
+	Opt_err
+};
+
+static const match_table_t arrayfs_tokens = {
+	{Opt_size, "size=%s"},
+	{Opt_nr_inodes, "nr_inodes=%s"},
+	{Opt_max_file_pages, "max_file_pages=%s"},
+	{Opt_pagecache, "pagecache"},
+	{Opt_dax, "dax"},
+	{Opt_err, NULL}
+};
+
+static int arrayfs_parse_options(char *options, struct arrayfs_mount_opts *opts)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p, *rest = "";
+	int token;
+
+	memset(opts, 0, sizeof(*opts));
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		token = match_token(p, arrayfs_tokens, args);
+		switch (token) {
+		case Opt_size:
+			opts->size = memparse(args[0].from, &rest);
+			break;
+		case Opt_nr_inodes:
+			opts->nr_inodes = memparse(args[0].from, &rest);
+			break;
+		case Opt_max_file_pages:
+			opts->max_file_pages = memparse(args[0].from, &rest);
+			break;
+		case Opt_pagecache:
+			opts->flags |= ARRAYFS_MOUNT_PAGECACHE;
+			rest = "";
+			break;
+		case Opt_dax:
+			opts->flags |= ARRAYFS_MOUNT_DAX;
+			rest = "";
+			break;
+		default:
+			pr_err("%s, unrecognized mount option \"%s\"\n",
+					__func__, p);
+			return -EINVAL;
+		}
+		if (*rest) {
+			pr_err("%s, bad value in \"%s\"\n",
+					__func__, p);
+			return -EINVAL;
+		}
+	}
+
+	if ((opts->flags & ARRAYFS_MOUNT_PAGECACHE) &&
+			(opts->flags & ARRAYFS_MOUNT_DAX)) {
+		pr_err("%s, pagecache and dax can't be used together\n",
+				__func__);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Work out nr_inodes, nr_blocks and max_file_pages from the mount
+ * options. size= sizes the block pool; without it the pool gets
+ * ARRAYFS_NR_PGS_PER_FILE blocks per inode, or one per inode in
+ * pagecache mode where only directories use it. A single file may
+ * grow to the whole pool unless max_file_pages= says otherwise.
+ */
+static int arrayfs_set_geometry(struct arrayfs_sb *sbi,
+				struct arrayfs_mount_opts *opts)
+{
+	unsigned long long blocks = opts->size >> PAGE_SHIFT;
+	unsigned long nr_inodes = opts->nr_inodes;
+	unsigned long max_file_pages = opts->max_file_pages;
+
+	if (opts->size && !blocks)
+		return -EINVAL;
+
+	if (!nr_inodes)
+		nr_inodes = ARRAYFS_NR_INODES;
+	if (!blocks) {
+		blocks = nr_inodes;
+		if (!test_opt(sbi, PAGECACHE))
+			blocks *= ARRAYFS_NR_PGS_PER_FILE;
+		/* Block 0 is reserved */
+		blocks++;
+	}
+	if (!max_file_pages) {
+		if (test_opt(sbi, PAGECACHE))
+			max_file_pages = MAX_LFS_FILESIZE >> PAGE_SHIFT;
+		else
+			max_file_pages = blocks - 1;
+	}
+
+	/* Directory entries and extents store 32 bit numbers */
+	if (nr_inodes > U32_MAX || blocks > U32_MAX || blocks <= ARRAYFS_ROOT_BLK)
+		return -EINVAL;
+	if (!test_opt(sbi, PAGECACHE) && max_file_pages > U32_MAX)
+		return -EINVAL;
+	if (max_file_pages > (MAX_LFS_FILESIZE >> PAGE_SHIFT))
+		return -EINVAL;
+
+	sbi->nr_inodes = nr_inodes;
+	sbi->nr_blocks = blocks;
+	sbi->max_file_pages = max_file_pages;
+	return 0;
+}
+
+static int arrayfs_alloc_storage(struct arrayfs_sb *sbi)
+{
+	int err, cpu;
+
+	err = arrayfs_alloc_chunks(sbi);
+	err = arrayfs_bitmap_init(&sbi->block_map, sbi->nr_blocks) ?: err;
+	sbi->disk_inodes = vzalloc(array_size(sbi->nr_inodes,
+					sizeof(struct arrayfs_disk_inode)));
+	err = arrayfs_bitmap_init(&sbi->inode_map, sbi->nr_inodes) ?: err;
+	sbi->mags = alloc_percpu(struct arrayfs_magazine);
+	if (sbi->mags) {
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(sbi->mags, cpu)->lock);
+	}
+	sbi->inode_table = kvcalloc(sbi->nr_inodes,
+					sizeof(struct inode *), GFP_KERNEL);
+	err = percpu_counter_init(&sbi->free_blocks, 0, GFP_KERNEL) ?: err;
+	err = percpu_counter_init(&sbi->free_inodes, 0, GFP_KERNEL) ?: err;
+	sbi->orphans = kvcalloc(BITS_TO_LONGS(sbi->nr_inodes),
+					sizeof(unsigned long), GFP_KERNEL);
+	INIT_WORK(&sbi->reclaim_work, arrayfs_reclaim_work);
+	sbi->reclaim_wq = alloc_workqueue("arrayfs-reclaim", WQ_UNBOUND, 1);
+	if (err || !sbi->mags || !sbi->disk_inodes || !sbi->inode_table ||
+			!sbi->orphans || !sbi->reclaim_wq) {
+		pr_err("%s, can't allocate %lu blocks of storage\n",
+				__func__, sbi->nr_blocks);
+		arrayfs_free_storage(sbi);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void mkfs_arrayfs(struct arrayfs_sb *sbi)
+{
+	struct arrayfs_disk_inode *di = &sbi->disk_inodes[0];
+	struct arrayfs_dir_data *dd =
+		(struct arrayfs_dir_data *)arrayfs_blk_addr(sbi, ARRAYFS_ROOT_BLK);
+
+	di->mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+	di->nlink = 2;
+	di->size = PAGE_SIZE;
+	di->nr_extents = 1;
+	di->extent.lblk = 0;
+	di->extent.pblk = ARRAYFS_ROOT_BLK;
+	di->extent.len = 1;
+	arrayfs_bitmap_set(&sbi->inode_map, 0, 1);
+	/* Block 0 and the root directory block */
+	arrayfs_bitmap_set(&sbi->block_map, 0, ARRAYFS_ROOT_BLK + 1);
+	percpu_counter_set(&sbi->free_inodes, sbi->nr_inodes - 1);
+	percpu_counter_set(&sbi->free_blocks,
+			sbi->nr_blocks - (ARRAYFS_ROOT_BLK + 1));
+	dd->level = 0;
+	memset(dd->tags, 0, sizeof(dd->tags));
+}
+
 static int arrayfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct arrayfs_sb *sbi;
+	struct arrayfs_mount_opts opts;
 	struct inode *root_inode;
+	unsigned int i;
 	int err;
 
-	spin_lock(&global_sb.m_lock);
-	if (global_sb.mounted) {
-		spin_unlock(&global_sb.m_lock);
-		pr_err("%s, already mounted\n",
-				__func__);
-		return -EBUSY;
-	}
-	global_sb.mounted = 1;
-	spin_unlock(&global_sb.m_lock);
-	sb->s_fs_info = sbi = &global_sb;
+	err = arrayfs_parse_options(data, &opts);
+	if (err)
+		return err;
+
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi)
+		return -ENOMEM;
+	/* Freed in arrayfs_umount, even if we fail below */
+	sb->s_fs_info = sbi;
 	sbi->sb = sb;
-	sbi->inode_bm = 0;
-	spin_lock_init(&sbi->inode_bmlock);
 	spin_lock_init(&sbi->cp_lock);
+	spin_lock_init(&sbi->blk_lock);
+	spin_lock_init(&sbi->dirty_lock);
+	INIT_LIST_HEAD(&sbi->dirty_inodes);
+	mutex_init(&sbi->sync_mutex);
+	for (i = 0; i < ARRAY_SIZE(sbi->dir_locks); i++) {
+		spin_lock_init(&sbi->dir_locks[i].lock);
+		seqcount_init(&sbi->dir_locks[i].seq);
+	}
+	sbi->mount_opt = opts.flags;
+
+	err = arrayfs_set_geometry(sbi, &opts);
+	if (err) {
+		pr_err("%s, bad geometry\n", __func__);
+		return err;
+	}
+	err = arrayfs_alloc_storage(sbi);
+	if (err)
+		return err;
+	mkfs_arrayfs(sbi);
+
+	/*
+	 * Buffered files need the flusher to copy their pages into the
+	 * array and to call write_inode; the noop bdi never does either.
+	 */
+	if (!test_opt(sbi, PAGECACHE)) {
+		err = super_setup_bdi(sb);
+		if (err)
+			goto free_storage;
+	}
+
 	sb->s_op = &arrayfs_sops;
+	sb->s_magic = ARRAYFS_SUPER_MAGIC;
+	sb->s_blocksize = PAGE_SIZE;
+	sb->s_blocksize_bits = PAGE_SHIFT;
+	sb->s_maxbytes = (loff_t)sbi->max_file_pages << PAGE_SHIFT;
+	pr_notice("%s, nr_inodes=%lu, nr_blocks=%lu, max_file_pages=%lu\n",
+			__func__, sbi->nr_inodes, sbi->nr_blocks,
+			sbi->max_file_pages);
 
 	/* Deal with root inode */
 	root_inode = arrayfs_iget(sb, 0);
@@ -623,12 +3689,12 @@ static int arrayfs_fill_super(struct super_block *sb, void *data, int silent)
 		pr_notice("%s, Can't get root inode\n",
 					__func__);
 		err = PTR_ERR(root_inode);
-		goto errout;
+		goto free_storage;
 	}
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		err = -ENOMEM;
-		goto errout; //No need to free anything
+		goto free_storage;
 	}
 
 	pr_notice("%s, Mount arrayfs succceed!\n",
@@ -636,10 +3702,8 @@ static int arrayfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	return 0;
 
-errout:
-	spin_lock(&global_sb.m_lock);
-	global_sb.mounted = 0;
-	spin_unlock(&global_sb.m_lock);
+free_storage:
+	arrayfs_free_storage(sbi);
 	return err;
 }
 
@@ -651,7 +3715,14 @@ static struct dentry *arrayfs_mount(struct file_system_type *fs_type, int flags,
 
 static void arrayfs_umount(struct super_block *sb)
 {
-	kill_anon_super(sb);
+	struct arrayfs_sb *sbi = ARRAYFS_SB(sb);
+
+	/* Pinned dentries are dropped the way ramfs does it */
+	if (sbi && test_opt(sbi, PAGECACHE))
+		kill_litter_super(sb);
+	else
+		kill_anon_super(sb);
+	kfree(sbi);
 }
 
 static struct file_system_type arrayfs_type = {
@@ -663,26 +3734,30 @@ static struct file_system_type arrayfs_type = {
 };
 MODULE_ALIAS_FS("arrayfs");
 
-static void mkfs_arrayfs(void)
+static void arrayfs_init_once(void *foo)
 {
-	struct arrayfs_disk_inode *di = &global_inodes[0];
-	struct arrayfs_dir_data *dd = (struct arrayfs_dir_data *)global_data[0][0];
+	struct arrayfs_inode *si = foo;
 
-	di->mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-	di->size = 0;
-	disk_inode_bm = 0;
-	set_bit(0, &disk_inode_bm);
-	dd->bitmap = 0;
+	inode_init_once(&si->vfs_inode);
+	init_rwsem(&si->i_map_sem);
+	init_rwsem(&si->i_mmap_sem);
+	init_rwsem(&si->i_dir_sem);
+	seqcount_init(&si->i_dir_seq);
+	INIT_LIST_HEAD(&si->i_dirty);
 }
 
 static int __init init_arrayfs(void)
 {
 	int err;
 
-	mkfs_arrayfs();
+	BUILD_BUG_ON(sizeof(struct arrayfs_disk_inode) != ARRAYFS_INODE_SIZE);
 
-	global_sb.mounted = 0;
-	spin_lock_init(&global_sb.m_lock);
+	arrayfs_inode_cachep = kmem_cache_create("arrayfs_inode_cache",
+				sizeof(struct arrayfs_inode), 0,
+				SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD |
+				SLAB_ACCOUNT, arrayfs_init_once);
+	if (!arrayfs_inode_cachep)
+		return -ENOMEM;
 
 	err = register_filesystem(&arrayfs_type);
 	if (err)
@@ -690,6 +3765,7 @@ static int __init init_arrayfs(void)
 	pr_notice("%s finished\n", __func__);
 	return 0;
 out:
+	kmem_cache_destroy(arrayfs_inode_cachep);
 	return err;
 }
 
@@ -697,6 +3773,9 @@ static void __exit exit_arrayfs(void)
 {
 	pr_notice("%s\n", __func__);
 	unregister_filesystem(&arrayfs_type);
+	/* Inodes and Bloom filters still waiting to be freed */
+	rcu_barrier();
+	kmem_cache_destroy(arrayfs_inode_cachep);
 }
 
 module_init(init_arrayfs)